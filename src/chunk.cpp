@@ -10,6 +10,19 @@ Chunk::Chunk(std::string filepath, const Level::position& pos)
     p_blocklight(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.BlockLight"))),
     p_data(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.Data"))) {
   position = {pos.first, pos.second, 0};
+  measure();
+}
+
+/* Parse a compressed chunk file that has already been read. */
+Chunk::Chunk(const std::vector<unsigned char>& compressed,
+             std::string filepath, const Level::position& pos)
+  : Parser(compressed, filepath),
+    p_blocks(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.Blocks"))),
+    p_skylight(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.SkyLight"))),
+    p_blocklight(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.BlockLight"))),
+    p_data(dynamic_cast<const NBT::TAG_Byte_Array*>(fetch("Level.Data"))) {
+  position = {pos.first, pos.second, 0};
+  measure();
 }
 
 /* Construct an empty dummy chunk. */
@@ -17,57 +30,56 @@ Chunk::Chunk(const Level::position& pos) : Parser(),
                                            p_blocks(0), p_skylight(0),
                                            p_blocklight(0), p_data(0) {
   position = {pos.first, pos.second, 0};
+  measure();
 }
 
-/* Get block type at position. */
-unsigned char Chunk::blocks(const pvector& pos) const {
-  if (!p_blocks)
-    throw std::runtime_error("Chunk has no Blocks section.");
+/* Return an array if it holds at least length bytes. */
+static const unsigned char* whole(const NBT::TAG_Byte_Array* array,
+                                  int length) {
+  if (!array || array->length < length)
+    return 0;
 
-  return p_blocks->payload[pos.nbt()];
+  return array->payload;
 }
 
-/* Get skylight at position. */
-unsigned char Chunk::skylight(const pvector& pos) const {
-  if (!p_skylight)
-    throw std::runtime_error("Chunk has no SkyLight section.");
-
-  bool upper;
-  unsigned char result = p_skylight->payload[pos.nbt(upper)];
-  if (upper)
-    result >>= 4;
-  else
-    result &= 0xf;
-
-  return result;
+/* Get whole arrays. */
+const unsigned char* Chunk::blocks() const {
+  return whole(p_blocks, 16 * 16 * 128);
 }
-
-/* Get blocklight at position. */
-unsigned char Chunk::blocklight(const pvector& pos) const {
-  if (!p_blocklight)
-    throw std::runtime_error("Chunk has no BlockLight section.");
-
-  bool upper;
-  unsigned char result = p_blocklight->payload[pos.nbt(upper)];
-  if (upper)
-    result >>= 4;
-  else
-    result &= 0xf;
-
-  return result;
+const unsigned char* Chunk::skylight() const {
+  return whole(p_skylight, 16 * 16 * 128 / 2);
+}
+const unsigned char* Chunk::blocklight() const {
+  return whole(p_blocklight, 16 * 16 * 128 / 2);
+}
+const unsigned char* Chunk::data() const {
+  return whole(p_data, 16 * 16 * 128 / 2);
 }
 
-/* Get data at position. */
-unsigned char Chunk::data(const pvector& pos) const {
-  if (!p_data)
-    throw std::runtime_error("Chunk has no Data section.");
+/* Find the height of each column. Columns are 128 blocks high and
+   lie one after another. */
+void Chunk::measure() {
+  const unsigned char* blocks = this->blocks();
+  for (int column = 0; column < 256; column++) {
+    int high = 0;
+    if (blocks) {
+      const unsigned char* stack = blocks + column * 128;
+#pragma omp simd reduction(max:high)
+      for (int y = 0; y < 128; y++) {
+        high = (stack[y] && y + 1 > high) ? y + 1 : high;
+      }
+    }
+    height[column] = high;
+  }
+}
 
-  bool upper;
-  unsigned char result = p_data->payload[pos.nbt(upper)];
-  if (upper)
-    result >>= 4;
-  else
-    result &= 0xf;
+/* Memory used by the block arrays of the chunk. */
+size_t Chunk::memory() const {
+  size_t result = sizeof(*this);
+  if (p_blocks) result += p_blocks->length;
+  if (p_skylight) result += p_skylight->length;
+  if (p_blocklight) result += p_blocklight->length;
+  if (p_data) result += p_data->length;
 
   return result;
 }
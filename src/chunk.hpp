@@ -5,6 +5,9 @@
 #include "level.hpp"
 #include "pvector.hpp"
 
+#include <vector>
+#include <stdexcept>
+
 /*
  * This class simplifies reading data from chunk NBTs.
  */
@@ -18,9 +21,18 @@ private:
   const NBT::TAG_Byte_Array* p_blocklight;
   const NBT::TAG_Byte_Array* p_data;
 
+  /* Height of each column above its highest block that isn't air. */
+  unsigned char height[256];
+
+  /* Find the height of each column. */
+  void measure();
+
 public:
   /* Read filepath into memory. */
   Chunk(std::string filepath, const Level::position& pos);
+  /* Parse a compressed chunk file that has already been read. */
+  Chunk(const std::vector<unsigned char>& compressed, std::string filepath,
+        const Level::position& pos);
   /* TODO: Add a no-position constructor, read position from chunk or
      throw an exception. */
   /* Construct an empty dummy chunk. */
@@ -32,6 +44,23 @@ public:
   unsigned char blocklight(const pvector& pos) const;
   unsigned char data(const pvector& pos) const;
 
+  /* Get whole arrays, indexed by pvector::nbt(). Returns 0 if the
+     chunk lacks the array or it is too short. */
+  const unsigned char* blocks() const;
+  const unsigned char* skylight() const;
+  const unsigned char* blocklight() const;
+  const unsigned char* data() const;
+
+  /* Get the height of each column, indexed as x * 16 + z. This is one
+     more than the height of its highest block that isn't air, or 0
+     for columns of air. It is found once when the chunk is read, and
+     shared by all renderers. All zero if the chunk has no blocks. */
+  const unsigned char* heights() const { return height; };
+
+  /* Approximate memory used by a decoded chunk. */
+  static const size_t estimated_memory = 84 * 1024;
+  size_t memory() const;
+
   /* Get chunk position. */
   pvector get_position() const { return position; };
 
@@ -40,4 +69,57 @@ public:
   bool operator>(const Chunk& chunk) const { return !operator<(chunk); };
 };
 
+/* Get block type at position. */
+inline unsigned char Chunk::blocks(const pvector& pos) const {
+  if (!p_blocks)
+    throw std::runtime_error("Chunk has no Blocks section.");
+
+  return p_blocks->payload[pos.nbt()];
+}
+
+/* Get skylight at position. */
+inline unsigned char Chunk::skylight(const pvector& pos) const {
+  if (!p_skylight)
+    throw std::runtime_error("Chunk has no SkyLight section.");
+
+  bool upper;
+  unsigned char result = p_skylight->payload[pos.nbt(upper)];
+  if (upper)
+    result >>= 4;
+  else
+    result &= 0xf;
+
+  return result;
+}
+
+/* Get blocklight at position. */
+inline unsigned char Chunk::blocklight(const pvector& pos) const {
+  if (!p_blocklight)
+    throw std::runtime_error("Chunk has no BlockLight section.");
+
+  bool upper;
+  unsigned char result = p_blocklight->payload[pos.nbt(upper)];
+  if (upper)
+    result >>= 4;
+  else
+    result &= 0xf;
+
+  return result;
+}
+
+/* Get data at position. */
+inline unsigned char Chunk::data(const pvector& pos) const {
+  if (!p_data)
+    throw std::runtime_error("Chunk has no Data section.");
+
+  bool upper;
+  unsigned char result = p_data->payload[pos.nbt(upper)];
+  if (upper)
+    result >>= 4;
+  else
+    result &= 0xf;
+
+  return result;
+}
+
 #endif
@@ -4,6 +4,7 @@
 
 #include <algorithm>
 #include <stdexcept>
+#include <vector>
 #include <png.h>
 
 /* Allocate and initialise memory. */
@@ -16,7 +17,7 @@ Image::Image(ivector dimensions, const Pixel* fill) :
   bool gotfill = true;
   if (!fill) {
     gotfill = false;
-    fill = new Pixel(0xff, 0xff, 0xff, 0x00);
+    fill = new Pixel();
   }
   for (int i = 0; i < size.x * size.y; i++) {
     data[i] = *fill;
@@ -41,6 +42,13 @@ Image::Image(const Image& source, int rotate) {
     corner = source.dimensions().y / 2;
   }
 
+  /* Pixels of a diagonal rotation are blended with the pixels around
+     them. Blend the whole source a row at a time first. */
+  std::vector<Pixel> blended;
+  if (rotate & 1) {
+    blended = blend_neighbours(source);
+  }
+
   data = new Pixel[size.x * size.y];
   for (int y = 0; y < size.y; y++) {
     for (int x = 0; x < size.x; x++) {
@@ -94,30 +102,7 @@ Image::Image(const Image& source, int rotate) {
         if (s_x >= 0 && s_y >= 0 &&
             s_x < source.dimensions().x && s_y < source.dimensions().y) {
 
-          /* Blend in surrounding pixels. */
-          Pixel dot;
-          if (s_x > 0) {
-            dot = source(s_x - 1, s_y);
-          }
-          if (s_y > 0) {
-            dot.mix(source(s_x, s_y - 1));
-          } else {
-            dot.mix({0, 0, 0, 0});
-          }
-          if (s_x < source.dimensions().x - 2) {
-            dot.mix(source(s_x + 1, s_y));
-          } else {
-            dot.mix({0, 0, 0, 0});
-          }
-          if (s_y < source.dimensions().y - 2) {
-            dot.mix(source(s_x, s_y + 1));
-          } else {
-            dot.mix({0, 0, 0, 0});
-          }
-
-          /* Write result. */
-          dot.mix(source(s_x, s_y));
-          (*this)(x,y) = dot;
+          (*this)(x,y) = blended[s_y * source.dimensions().x + s_x];
         }
       } break;
       }
@@ -125,6 +110,53 @@ Image::Image(const Image& source, int rotate) {
   }
 }
 
+/* Mix each pixel of an image with the pixels around it, in the order
+   left, above, right, below and itself. Off the image, as well as
+   right of the last column but one and below the last row but one,
+   is transparent. */
+std::vector<Pixel> Image::blend_neighbours(const Image& source) {
+  const int w = source.size.x;
+  const int h = source.size.y;
+  const Pixel none;
+  std::vector<Pixel> result(w * h);
+  std::vector<Pixel> shifted(w);
+  for (int y = 0; y < h; y++) {
+    const Pixel* row = source.data + y * w;
+    Pixel* dot = &result[y * w];
+
+    /* Left. */
+    dot[0] = none;
+    std::copy(row, row + w - 1, dot + 1);
+
+    /* Above. */
+    if (y > 0) {
+      Pixel::mix_span(dot, row - w, w);
+    } else {
+      std::fill(shifted.begin(), shifted.end(), none);
+      Pixel::mix_span(dot, &shifted[0], w);
+    }
+
+    /* Right. */
+    std::fill(shifted.begin(), shifted.end(), none);
+    if (w > 2) {
+      std::copy(row + 1, row + w - 1, shifted.begin());
+    }
+    Pixel::mix_span(dot, &shifted[0], w);
+
+    /* Below. */
+    if (y < h - 2) {
+      Pixel::mix_span(dot, row + w, w);
+    } else {
+      std::fill(shifted.begin(), shifted.end(), none);
+      Pixel::mix_span(dot, &shifted[0], w);
+    }
+
+    /* Itself. */
+    Pixel::mix_span(dot, row, w);
+  }
+  return result;
+}
+
 /* Duplicate image data on assignment. */
 Image& Image::operator=(const Image& source) {
   size = source.dimensions();
@@ -151,15 +183,15 @@ Image::~Image() {
 void Image::overlay(const Image& source) {
   int xtop = (size.x < source.dimensions().x) ? size.x : source.dimensions().x;
   int ytop = (size.y < source.dimensions().y) ? size.y : source.dimensions().y;
-  for (int x = 0; x < xtop; x++) {
-    for (int y = 0; y < ytop; y++) {
-      data[y*size.x + x].blend_over(source(x,y));
-    }
+  for (int y = 0; y < ytop; y++) {
+    Pixel::blend_over_span(data + y*size.x, source.data + y*source.size.x,
+                           xtop);
   }
 }
 
 /* Write results to file. */
-void Image::output(std::string filename, bool trim) const {
+void Image::output(std::string filename, bool trim,
+                   const std::list<text>& texts) const {
   int top = 0;
   int left = 0;
   int width = size.x;
@@ -244,6 +276,20 @@ void Image::output(std::string filename, bool trim) const {
   png_set_IHDR(png_ptr, info_ptr, width, height,
                8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
                PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+  /* Texts go before the image data. Long ones are compressed. */
+  std::vector<png_text> chunks(texts.size());
+  int n = 0;
+  for (std::list<text>::const_iterator it = texts.begin();
+       it != texts.end(); ++it, n++) {
+    chunks[n].compression = (it->second.size() > 1024) ?
+      PNG_TEXT_COMPRESSION_zTXt : PNG_TEXT_COMPRESSION_NONE;
+    chunks[n].key = const_cast<char*>(it->first.c_str());
+    chunks[n].text = const_cast<char*>(it->second.c_str());
+    chunks[n].text_length = it->second.size();
+  }
+  if (n > 0)
+    png_set_text(png_ptr, info_ptr, chunks.data(), n);
   png_write_info(png_ptr, info_ptr);
 
 
@@ -251,8 +297,15 @@ void Image::output(std::string filename, bool trim) const {
   if (setjmp(png_jmpbuf(png_ptr))){
     throw std::runtime_error(filename + ": writing failed.");
   }
+  std::vector<Pixel> row(width);
   for (int i = top; i < (top + height); i++){
-    png_write_row(png_ptr, (png_byte*)(data + i*size.x + left));
+    /* Files hold straight alpha. */
+    const Pixel* line = data + i*size.x + left;
+    for (size_t x = 0; x < row.size(); x++) {
+      row[x] = line[x];
+      row[x].straighten();
+    }
+    png_write_row(png_ptr, (png_byte*)row.data());
   }
 
 
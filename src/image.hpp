@@ -4,6 +4,9 @@
 #include "pvector.hpp"
 
 #include <string>
+#include <list>
+#include <utility>
+#include <vector>
 
 class Pixel;
 
@@ -31,8 +34,11 @@ public:
   /* Alpha blend another image on top of this one. */
   void overlay(const Image& source);
 
-  /* Write results to file. */
-  void output(std::string filename, bool trim = true) const;
+  /* Write results to file, with a text chunk for each keyword and
+     text given. */
+  typedef std::pair<std::string, std::string> text;
+  void output(std::string filename, bool trim = true,
+              const std::list<text>& texts = std::list<text>()) const;
 
   /* Get image dimensions. */
   ivector dimensions() const { return size; };
@@ -50,6 +56,9 @@ private:
 
   /* Raw image data. */
   Pixel* data;
+
+  /* Pixels mixed with their neighbours, for diagonal rotation. */
+  static std::vector<Pixel> blend_neighbours(const Image& source);
 };
 
 #endif
@@ -34,6 +34,48 @@ int stringtoint(const std::string& s) {
   return (sign != 0) ? i * sign : i;
 }
 
+/*
+ * Convert a size with an optional K, M or G suffix to bytes.
+ */
+size_t stringtosize(const std::string& s) {
+  if (s.empty())
+    throw std::runtime_error("Not a size.");
+
+  size_t multiplier = 1;
+  std::string number = s;
+  switch (s[s.length() - 1]) {
+  case 'k': case 'K': multiplier = 1024; break;
+  case 'm': case 'M': multiplier = 1024 * 1024; break;
+  case 'g': case 'G': multiplier = 1024 * 1024 * 1024; break;
+  }
+  if (multiplier > 1)
+    number = s.substr(0, s.length() - 1);
+
+  if (!number.empty() && number[0] == '+')
+    number = number.substr(1);
+  if (number.empty())
+    throw std::runtime_error("Not a size.");
+  if (number[0] == '-')
+    throw std::runtime_error("Negative size.");
+
+  /* Parse digit by digit, so sizes beyond the range of int work, and
+     ones beyond size_t are caught rather than wrapped. */
+  const unsigned long long limit = (size_t)-1;
+  unsigned long long size = 0;
+  for (size_t i = 0; i < number.length(); i++) {
+    if (number[i] < '0' || number[i] > '9')
+      throw std::runtime_error("Not a size.");
+    unsigned digit = number[i] - '0';
+    if (size > (limit - digit) / 10)
+      throw std::runtime_error("Size too large.");
+    size = size * 10 + digit;
+  }
+  if (size > limit / multiplier)
+    throw std::runtime_error("Size too large.");
+
+  return (size_t)(size * multiplier);
+}
+
 /* Fetch the Minecraft save directory with a trailing "/". */
 std::string savepath() {
   std::string result;
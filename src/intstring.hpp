@@ -8,6 +8,9 @@
 /* Convert a (signed) string to an integer. */
 int stringtoint(const std::string& s);
 
+/* Convert a size with an optional K, M or G suffix to bytes. */
+size_t stringtosize(const std::string& s);
+
 /* Fetch the Minecraft save directory with a trailing "/". */
 std::string savepath();
 
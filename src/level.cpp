@@ -1,18 +1,39 @@
+#include "../config.h"
 #include "output.hpp"
 #include "level.hpp"
 #include "chunk.hpp"
 #include "renderer.hpp"
 #include "image.hpp"
 #include "intstring.hpp"
+#include "loader.hpp"
 
 #include <sstream>
 #include <stack>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 #include <dirent.h>
 #include <sys/stat.h>
 
 #include <stdexcept>
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+/* Number of files to read from disk at once. */
+static const size_t read_batch = 256;
+
+/* Steps a render worker draws with one renderer before it looks for
+   one further behind. */
+static const int render_run = 16;
+
+/* Chunks less than this far apart are considered part of the same
+   area when looking for outliers. */
+static const int cluster_gap = 8;
+
 /* Yielding some cpu time to other threads. */
 #ifdef HAVE_WINDOWS_H
   #include <windows.h>
@@ -25,7 +46,8 @@
 #endif
 
 /* Find all chunk files. */
-Level::Level(const std::string& path) {
+Level::Level(const std::string& path)
+  : memory_limit(0), order(ROWS) {
   std::stack<std::string> directories;
 
   directories.push(path);
@@ -72,8 +94,7 @@ Level::Level(const std::string& path) {
             /* Chunk file name found. Add to map. */
             position pos(base36toint(x), base36toint(z));
             update_bounds(pos);
-            chunks.insert(std::pair<position, datasource>
-                          (pos, datasource(entryname, (Chunk*)0)));
+            chunks.insert(std::pair<position, std::string>(pos, entryname));
           }
         }
       }
@@ -86,7 +107,8 @@ Level::Level(const std::string& path) {
 
 /* Find requested chunk files. */
 Level::Level(const std::string& path,
-             const std::list<position>& intersect) {
+             const std::list<position>& intersect)
+  : memory_limit(0), order(ROWS) {
   /* Loop through intersect and see if the corresponding files exist. */
   for (std::list<position>::const_iterator it =
          intersect.begin();
@@ -102,17 +124,259 @@ Level::Level(const std::string& path,
       /* Chunk file name found. Add to map. */
       position pos(it->first, it->second);
       update_bounds(pos);
-      chunks.insert(std::pair<position, datasource>
-                    (pos, datasource(file, (Chunk*)0)));
+      chunks.insert(std::pair<position, std::string>(pos, file));
     }
   }
 }
 
-/* Clear chunk map on delete. */
-Level::~Level() {
-  for (chunkmap::reverse_iterator it = chunks.rbegin();
-       it != chunks.rend(); ++it) {
-    delete it->second.second;
+/* Cell a chunk belongs to when looking for outliers. */
+static Level::position outlier_cell(const Level::position& pos) {
+  Level::position cell(pos.first / cluster_gap, pos.second / cluster_gap);
+  if (pos.first < 0 && pos.first % cluster_gap) cell.first--;
+  if (pos.second < 0 && pos.second % cluster_gap) cell.second--;
+  return cell;
+}
+
+/* Size of a bounding box in chunks, as WxH. */
+static std::string extent(const Level::position& top_right,
+                          const Level::position& bottom_left) {
+  std::ostringstream result;
+  result << bottom_left.second - top_right.second + 1 << "x"
+         << bottom_left.first - top_right.first + 1;
+  return result.str();
+}
+
+/* A bounding box in chunks as WxH+Z+X, the form --chunks takes. */
+static std::string geometry(const Level::position& top_right,
+                            const Level::position& bottom_left) {
+  std::ostringstream result;
+  result << extent(top_right, bottom_left) << std::showpos
+         << top_right.second << top_right.first;
+  return result.str();
+}
+
+/* Grow a bounding box to cover pos. */
+static void cover(Level::position& top_right, Level::position& bottom_left,
+                  const Level::position& pos) {
+  if (pos.first < top_right.first) top_right.first = pos.first;
+  if (pos.second < top_right.second) top_right.second = pos.second;
+  if (pos.first > bottom_left.first) bottom_left.first = pos.first;
+  if (pos.second > bottom_left.second) bottom_left.second = pos.second;
+}
+
+/* What an outlying chunk holds. Only empty and unpopulated chunks
+   are left out of the map. */
+enum outlier_content { UNREADABLE, EMPTY, UNPOPULATED, TERRAIN, CONTENTS };
+static const char* const content_names[CONTENTS] = {
+  "unreadable", "empty", "not populated", "with terrain"
+};
+
+/* Look inside a chunk file that has been read. */
+static outlier_content classify(const Loader::request& file,
+                                const Level::position& pos) {
+  if (!file.error.empty())
+    return UNREADABLE;
+
+  try {
+    Chunk chunk(file.data, file.path, pos);
+    const NBT::TAG_Byte* populated =
+      dynamic_cast<const NBT::TAG_Byte*>
+      (chunk.fetch("Level.TerrainPopulated"));
+    const NBT::TAG_Byte_Array* blocks =
+      dynamic_cast<const NBT::TAG_Byte_Array*>(chunk.fetch("Level.Blocks"));
+
+    for (int b = 0; blocks && b < blocks->length; b++) {
+      if (blocks->payload[b] != 0) {
+        return (populated && populated->payload) ? TERRAIN : UNPOPULATED;
+      }
+    }
+    return EMPTY;
+  } catch (std::exception& e) {
+    debug << e.what() << std::endl;
+    return UNREADABLE;
+  }
+}
+
+/* Find chunks lying far away from the rest of the map. */
+void Level::prefilter(bool exclude) {
+  Loader loader(read_batch);
+  prefilter(exclude, loader);
+}
+void Level::prefilter(bool exclude, Loader& loader) {
+  if (chunks.empty())
+    return;
+
+  /* Sort chunks into cells, and count the chunks in each. */
+  std::map<position, int> cells;
+  for (chunkmap::const_iterator it = chunks.begin(); it != chunks.end();
+       ++it) {
+    cells[outlier_cell(it->first)]++;
+  }
+
+  /* Cells touching each other make up a cluster. */
+  std::map<position, int> cluster;
+  std::vector<int> cluster_size;
+  for (std::map<position, int>::const_iterator cell = cells.begin();
+       cell != cells.end(); ++cell) {
+    if (cluster.count(cell->first))
+      continue;
+
+    int id = cluster_size.size();
+    cluster_size.push_back(0);
+    std::stack<position> fill;
+    fill.push(cell->first);
+    cluster[cell->first] = id;
+    while (!fill.empty()) {
+      position current = fill.top();
+      fill.pop();
+      cluster_size[id] += cells[current];
+
+      for (int dx = -1; dx <= 1; dx++) {
+        for (int dz = -1; dz <= 1; dz++) {
+          position next(current.first + dx, current.second + dz);
+          if (cells.count(next) && !cluster.count(next)) {
+            cluster[next] = id;
+            fill.push(next);
+          }
+        }
+      }
+    }
+  }
+  int largest = 0;
+  for (size_t i = 0; i < cluster_size.size(); i++) {
+    if (cluster_size[i] > largest)
+      largest = cluster_size[i];
+  }
+
+  /* Clusters much smaller than the largest one are outliers. */
+  std::vector<position> outliers;
+  for (chunkmap::const_iterator it = chunks.begin(); it != chunks.end();
+       ++it) {
+    if (cluster_size[cluster[outlier_cell(it->first)]] * 20 < largest)
+      outliers.push_back(it->first);
+  }
+  if (outliers.empty()) {
+    debug << "No outlying chunks found." << std::endl;
+    return;
+  }
+
+  /* Look inside every outlier, a batch of files at a time. */
+  std::vector<outlier_content> content(outliers.size());
+  for (size_t first = 0; first < outliers.size(); first += read_batch) {
+    size_t count = std::min(read_batch, outliers.size() - first);
+    std::vector<Loader::request> files(count);
+    for (size_t i = 0; i < count; i++) {
+      files[i].path = chunks[outliers[first + i]];
+    }
+    loader.read(files);
+    for (size_t i = 0; i < count; i++) {
+      content[first + i] = classify(files[i], outliers[first + i]);
+    }
+  }
+
+  /* Sum up each outlying cluster. */
+  struct summary {
+    position top_right, bottom_left;
+    int count[CONTENTS];
+  };
+  std::map<int, summary> clusters;
+  for (size_t i = 0; i < outliers.size(); i++) {
+    int id = cluster[outlier_cell(outliers[i])];
+    std::map<int, summary>::iterator found = clusters.find(id);
+    if (found == clusters.end()) {
+      summary first = { outliers[i], outliers[i], { 0 } };
+      found = clusters.insert(std::make_pair(id, first)).first;
+    }
+    cover(found->second.top_right, found->second.bottom_left, outliers[i]);
+    found->second.count[content[i]]++;
+  }
+
+  std::cerr << "Warning: " << outliers.size() << " chunks in "
+            << clusters.size() << " clusters lie far away from the rest "
+            << "of the map:" << std::endl;
+  int listed = 0;
+  for (std::map<int, summary>::const_iterator it = clusters.begin();
+       it != clusters.end(); ++it) {
+    /* Don't flood the terminal. */
+    if (listed++ == 10) {
+      std::cerr << "  ..." << std::endl;
+      break;
+    }
+
+    std::cerr << "  " << geometry(it->second.top_right,
+                                  it->second.bottom_left) << ":";
+    const char* separator = " ";
+    for (int c = 0; c < CONTENTS; c++) {
+      if (it->second.count[c] > 0) {
+        std::cerr << separator << it->second.count[c] << " "
+                  << content_names[c];
+        separator = ", ";
+      }
+    }
+    std::cerr << std::endl;
+  }
+
+  /* Find the bounds without the outliers that are empty or not
+     populated. Outliers with terrain, or that couldn't be read, stay
+     on the map. */
+  std::vector<position> droppable;
+  for (size_t i = 0; i < outliers.size(); i++) {
+    if (content[i] == EMPTY || content[i] == UNPOPULATED)
+      droppable.push_back(outliers[i]);
+  }
+  if (droppable.empty()) {
+    std::cerr << "They all hold terrain or couldn't be read, so they are "
+              << "kept." << std::endl;
+    return;
+  }
+  std::set<position> dropped(droppable.begin(), droppable.end());
+  position kept_top_right = bottom_left, kept_bottom_left = top_right;
+  for (chunkmap::const_iterator it = chunks.begin(); it != chunks.end();
+       ++it) {
+    if (!dropped.count(it->first))
+      cover(kept_top_right, kept_bottom_left, it->first);
+  }
+
+  if (exclude) {
+    std::cerr << "Leaving out the " << droppable.size() << " that are "
+              << "empty or not populated. The map shrinks from "
+              << geometry(top_right, bottom_left) << " to "
+              << geometry(kept_top_right, kept_bottom_left) << " chunks."
+              << std::endl;
+    for (size_t i = 0; i < droppable.size(); i++) {
+      chunks.erase(droppable[i]);
+    }
+    top_right = kept_top_right;
+    bottom_left = kept_bottom_left;
+  } else {
+    std::cerr << "The " << droppable.size() << " that are empty or not "
+              << "populated grow the map from "
+              << geometry(kept_top_right, kept_bottom_left) << " to "
+              << geometry(top_right, bottom_left) << " chunks. Use "
+              << "--prefilter=exclude to leave them out." << std::endl;
+  }
+}
+
+/* Does any chunk lie within the rectangle with these corners? */
+bool Level::has_chunks(const position& top_right,
+                       const position& bottom_left) const {
+  chunkmap::const_iterator it = chunks.lower_bound(top_right);
+  for (; it != chunks.end() && it->first <= bottom_left; ++it) {
+    if (it->first.second >= top_right.second &&
+        it->first.second <= bottom_left.second)
+      return true;
+  }
+  return false;
+}
+
+/* Limit the memory used by decoded chunks while rendering. */
+void Level::set_memory_limit(size_t bytes) {
+  memory_limit = bytes;
+  size_t floor = min_resident * Chunk::estimated_memory;
+  if (bytes > 0 && bytes < floor) {
+    std::cerr << "Warning: The memory limit is below the " << min_resident
+              << " chunks needed to render. Using " << floor / 1024
+              << "K instead." << std::endl;
   }
 }
 
@@ -123,6 +387,13 @@ void Level::render(Renderer& renderer) {
   render(renderers);
 }
 void Level::render(list<Renderer*>& renderers) {
+  Loader loader(read_batch);
+  render(renderers, loader);
+}
+void Level::render(list<Renderer*>& renderers, Loader& loader) {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+
   /* Make sure there is something to render. */
   if (chunks.empty()) {
     throw std::logic_error("No chunks found.");
@@ -133,137 +404,769 @@ void Level::render(list<Renderer*>& renderers) {
     throw std::logic_error("No renderers specified.");
   }
 
-  /* Initialise renderers with map size. */
+  /* Find the chunks each renderer covers. Only chunks covered by
+     some renderer are read, and each is read only once. */
+  chunkmap wanted;
+  bool whole_map = false;
+  for (list<Renderer*>::iterator renderer = renderers.begin();
+       renderer != renderers.end(); ++renderer) {
+    const Renderer::regionopt& area = (*renderer)->get_recipe().area;
+    if (area.second.empty()) {
+      whole_map = true;
+      continue;
+    }
+
+    chunkmap::const_iterator it = chunks.lower_bound(area.first.top_right);
+    for (; it != chunks.end() && it->first <= area.first.bottom_left; ++it) {
+      if (area.first.contains(it->first))
+        wanted.insert(*it);
+    }
+  }
+  if (whole_map)
+    wanted = chunks;
+
+  /* Renderers that differ only in lighting share raycasts, and
+     top-down ones that differ only in direction share images. */
+  int fused = Renderer::fuse(renderers);
+  if (fused > 0) {
+    verbose << "Drawing " << fused << " of " << renderers.size()
+            << " maps along with others." << std::endl;
+  }
+
+  /* Initialise renderers with the size of their maps. */
   for (list<Renderer*>::iterator renderer = renderers.begin();
        renderer != renderers.end(); ++renderer) {
     debug << "Initializing renderer..." << std::endl;
-    (*renderer)->set_surface(top_right, bottom_left);
+    const Renderer::regionopt& area = (*renderer)->get_recipe().area;
+    if (area.second.empty()) {
+      (*renderer)->set_surface(top_right, bottom_left);
+      continue;
+    }
+
+    /* Shrink the region to the chunks that exist within it. */
+    position corner[2];
+    bool found = false;
+    for (chunkmap::const_iterator it = wanted.begin(); it != wanted.end();
+         ++it) {
+      const position& pos = it->first;
+      if (!area.first.contains(pos)) {
+        continue;
+      } else if (!found) {
+        corner[0] = corner[1] = pos;
+        found = true;
+      } else {
+        if (pos.first < corner[0].first) corner[0].first = pos.first;
+        if (pos.second < corner[0].second) corner[0].second = pos.second;
+        if (pos.first > corner[1].first) corner[1].first = pos.first;
+        if (pos.second > corner[1].second) corner[1].second = pos.second;
+      }
+    }
+    if (!found) {
+      throw std::logic_error(std::string("No chunks found for ")
+                             + area.second + ".");
+    }
+    (*renderer)->set_surface(corner[0], corner[1]);
+  }
+
+  /* Oblique maps need each row and column of chunks in order. A
+     Hilbert curve doesn't keep that, but Z-order does. */
+  traversal curve = order;
+  if (curve == HILBERT) {
+    for (list<Renderer*>::iterator renderer = renderers.begin();
+         renderer != renderers.end(); ++renderer) {
+      if ((*renderer)->get_recipe().oblique.first) {
+        std::cerr << "Warning: Oblique maps cannot be rendered in Hilbert "
+                  << "order. Using Z-order instead." << std::endl;
+        curve = ZORDER;
+        break;
+      }
+    }
+  }
+
+  /* Oblique maps must meet each chunk either after all the chunks in
+     front of it or before them all, and are drawn faster meeting the
+     front first. Reading the map costs more than that saves, so find
+     the fewest passes every map can be drawn in, and then the ones
+     letting the most maps be drawn front to back. */
+  int best = 0;
+  int best_passes = MIRRORS + 1;
+  int best_front = -1;
+  for (int set = 1; set < (1 << MIRRORS); set++) {
+    int passes = 0;
+    for (int mirror = 0; mirror < MIRRORS; mirror++) {
+      if (set & (1 << mirror))
+        passes++;
+    }
+
+    bool drawable = true;
+    int front = 0;
+    for (list<Renderer*>::iterator renderer = renderers.begin();
+         drawable && renderer != renderers.end(); ++renderer) {
+      bool fits = false;
+      bool front_first = false;
+      for (int mirror = 0; mirror < MIRRORS; mirror++) {
+        if (!(set & (1 << mirror)))
+          continue;
+        pass_fit how = fit(**renderer, mirror);
+        fits = fits || (how != UNFIT);
+        front_first = front_first || (how == FRONT_FIRST);
+      }
+      drawable = fits;
+      if (front_first)
+        front++;
+    }
+
+    if (drawable && (passes < best_passes ||
+                     (passes == best_passes && front > best_front))) {
+      best = set;
+      best_passes = passes;
+      best_front = front;
+    }
+  }
+
+  /* Give each map to a pass it meets the front of first, if there is
+     one, or else to the first it can be drawn in. */
+  list<Renderer*> passes[MIRRORS];
+  for (list<Renderer*>::iterator renderer = renderers.begin();
+       renderer != renderers.end(); ++renderer) {
+    int chosen = -1;
+    for (int mirror = 0; mirror < MIRRORS; mirror++) {
+      if (!(best & (1 << mirror)))
+        continue;
+      pass_fit how = fit(**renderer, mirror);
+      if (how == FRONT_FIRST) {
+        chosen = mirror;
+        break;
+      } else if (how != UNFIT && chosen < 0) {
+        chosen = mirror;
+      }
+    }
+    (*renderer)->set_front_to_back(fit(**renderer, chosen) == FRONT_FIRST);
+    passes[chosen].push_back(*renderer);
+  }
+
+  /* The deadline counts from the start, and covers every pass. */
+  size_t pass_count = 0;
+  for (int mirror = 0; mirror < MIRRORS; mirror++) {
+    if (!passes[mirror].empty())
+      pass_count++;
+  }
+  pace.start = start;
+  pace.begin(pass_count * wanted.size());
+
+  bool first_pass = true;
+  for (int mirror = 0; mirror < MIRRORS; mirror++) {
+    if (passes[mirror].empty())
+      continue;
+
+    if (!first_pass) {
+      verbose << "Reading the map again for maps facing other ways."
+              << std::endl;
+    }
+    first_pass = false;
+
+    if (mirror == 0) {
+      render_pass(passes[mirror], wanted, curve, mirror, loader);
+      continue;
+    }
+    chunkmap mirror_map;
+    for (chunkmap::const_iterator it = wanted.begin(); it != wanted.end();
+         ++it) {
+      mirror_map.insert(chunkmap::value_type(mirrored(it->first, mirror),
+                                             it->second));
+    }
+    render_pass(passes[mirror], mirror_map, curve, mirror, loader);
   }
 
-  /* Initialize iterator for deleting chunks we are finished with. */
-  chunkmap::reverse_iterator deleter = chunks.rbegin();
+  /* Report how the deadline was kept. */
+  if (pace.seconds > 0) {
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    int lowered = 0;
+    for (int quality = Renderer::UNLIT; quality < Renderer::QUALITIES;
+         quality++) {
+      lowered += pace.chunks[quality];
+    }
+    verbose << "Rendered " << lowered << " chunks in lower quality to "
+            << "meet the deadline." << std::endl;
+    if (elapsed.count() > pace.seconds) {
+      std::cerr << "Warning: Missed the deadline by "
+                << elapsed.count() - pace.seconds << " seconds."
+                << std::endl;
+    }
+  }
+
+  /* Finalise all renderers. */
+  Renderer::finalise_all(renderers);
 
-  /* Load and render chunks in parallel. */
+  /* Report the time saved by rotating shared images. */
+  double saved = 0;
+  for (list<Renderer*>::iterator renderer = renderers.begin();
+       renderer != renderers.end(); ++renderer) {
+    saved += (*renderer)->saved_seconds();
+  }
+  if (saved > 0) {
+    verbose << "Sharing images saved " << saved << " seconds of rendering."
+            << std::endl;
+  }
+}
+
+/* How a renderer would meet the chunks of a pass mirrored along the
+   given axes. */
+Level::pass_fit Level::fit(const Renderer& renderer, int mirror) {
+  /* Reverse map order meets higher coordinates first. */
+  int x, z;
+  renderer.front_side(x, z);
+  if (mirror & MIRROR_X)
+    x = -x;
+  if (mirror & MIRROR_Z)
+    z = -z;
+
+  if (x * z < 0)
+    return UNFIT;
+  else if (x + z > 0)
+    return FRONT_FIRST;
+  else if (x + z < 0)
+    return BACK_FIRST;
+  return EITHER;
+}
+
+/* Start pacing a number of chunks. */
+void Level::pacer::begin(size_t chunks) {
+  chunks_left = chunks;
+  cost.assign(Renderer::QUALITIES, 0);
+  waiting = 0;
+  this->chunks.assign(Renderer::QUALITIES, 0);
+}
+
+/* The best quality whose cost fits the time left for each chunk.
+   Qualities not tried yet are taken to fit. */
+int Level::pacer::quality() const {
+  if (seconds <= 0)
+    return Renderer::FULL;
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  double each = (seconds - elapsed.count()) /
+    (chunks_left > 0 ? chunks_left : 1) - waiting;
+  int result = Renderer::FULL;
+  while (result + 1 < Renderer::QUALITIES && cost[result] > each)
+    result++;
+
+  return result;
+}
+
+/* Follow the cost of a chunk drawn in a quality, after waiting for
+   it to load. The costs of the other qualities are scaled along, as
+   chunks get easier or harder to draw. A chunk counts as at most
+   twice the cost so far, so that the odd thread preempted while
+   drawing doesn't lower the quality of the chunks after it. */
+void Level::pacer::rendered(int quality, double drawing, double waited) {
+  if (chunks_left > 0)
+    chunks_left--;
+  chunks[quality]++;
+  waiting += 0.1 * (waited - waiting);
+
+  if (cost[quality] == 0) {
+    cost[quality] = drawing;
+    return;
+  }
+  double ratio = std::min(drawing / cost[quality], 2.0);
+  for (int i = 0; i < Renderer::QUALITIES; i++) {
+    cost[i] += 0.1 * (cost[i] * ratio - cost[i]);
+  }
+}
+
+/* Load the chunks of source while rendering them with each renderer
+   covering them. If mirror is set, source holds the map mirrored
+   along those axes, and is rendered as the map it mirrors. */
+void Level::render_pass(list<Renderer*>& renderers, const chunkmap& source,
+                        traversal curve, int mirror, Loader& loader) {
+  /* Decide the order chunks are loaded, rendered and freed in. */
+  schedule plan;
+  make_schedule(plan, source, 0, curve);
+  size_t max_resident = (size_t)-1;
+  if (memory_limit > 0) {
+    max_resident = memory_limit / Chunk::estimated_memory;
+    if (max_resident < min_resident)
+      max_resident = min_resident;
+
+    if (plan.peak > max_resident && curve == ROWS) {
+      /* A row doesn't fit. Render in bands narrow enough that two
+         rows of a band do, with some room for reading ahead. */
+      int width = (max_resident - 8) / 2;
+      do {
+        make_schedule(plan, source, width);
+        width /= 2;
+      } while (plan.peak > max_resident && width > 0);
+
+      verbose << "Rendering in bands of " << plan.band_width
+              << " chunks to stay within the memory limit." << std::endl;
+    }
+    if (plan.peak > max_resident) {
+      std::cerr << "Warning: Cannot stay within the memory limit. "
+                << plan.peak << " chunks must be kept in memory."
+                << std::endl;
+      max_resident = plan.peak;
+    }
+  }
+  debug << "Rendering needs up to " << plan.peak
+        << " chunks in memory at once." << std::endl;
+
+  /* Files are read and decoded in the order they are first needed. */
+  std::vector<Loader::request> files(plan.loads.size());
+  std::vector<Chunk*> slots(plan.loads.size(), (Chunk*)0);
+  for (size_t i = 0; i < plan.loads.size(); i++) {
+    files[i].path = plan.loads[i]->second;
+  }
+  int files_read = 0;  // Number of files that have been read.
+  int decoded = 0;     // Number of files that have been decoded.
+  int rendering = 0;   // The step currently being rendered.
+
+  /* Memory use of decoded chunks. */
+  size_t resident = 0;
+  size_t resident_bytes = 0;
+  size_t peak = 0;
+  size_t peak_bytes = 0;
+
+#ifdef _OPENMP
+  /* Let decoding and rendering spread out over threads of their own. */
+  if (omp_get_max_active_levels() < omp_get_active_level() + 2)
+    omp_set_max_active_levels(omp_get_active_level() + 2);
+#endif
+
+  /* Load and render chunks in parallel. The sections wait for each
+     other, so they must all get a thread. */
   debug << "Initializing parallel loading..." << std::endl;
-#pragma omp parallel sections
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+#pragma omp parallel sections num_threads(3)
   {
 #pragma omp section
     {
-      /* Load files into memory. */
-      for (chunkmap::reverse_iterator it = chunks.rbegin();
-           it != chunks.rend(); ++it) {
-        Chunk* load;
-        try {
-          load = new Chunk(it->second.first, it->first);
-        } catch (std::exception& e) {
-          std::cerr << "Failed to load chunk "
-                    << it->first.second << "x" << it->first.first << std::endl;
-          debug << e.what() << std::endl;
-          load = new Chunk(it->first);
+      /* Read files into memory, a batch at a time. */
+      debug << "Reading files using " << loader.backend() << std::endl;
+      for (size_t first = 0; first < files.size(); first += read_batch) {
+        size_t last = first + read_batch;
+        if (last > files.size())
+          last = files.size();
+
+#ifdef _OPENMP
+        /* Don't read too far ahead of the decoder. */
+        int done;
+#pragma omp critical(files)
+        done = decoded;
+        while ((int)first - done > 2 * (int)read_batch) {
+          yield();
+#pragma omp critical(files)
+          done = decoded;
+        }
+#endif
+
+        std::vector<Loader::request> batch(last - first);
+        for (size_t i = first; i < last; i++) {
+          batch[i - first].path.swap(files[i].path);
+        }
+        loader.read(batch);
+
+#pragma omp critical(files)
+        {
+          for (size_t i = first; i < last; i++) {
+            files[i].data.swap(batch[i - first].data);
+            files[i].error.swap(batch[i - first].error);
+          }
+          files_read = last;
         }
-#pragma omp critical(chunks)
-        it->second.second = load;
       }
     }
 
 #pragma omp section
     {
-      /* Render loaded chunks. */
-      for (chunkmap::reverse_iterator it = chunks.rbegin();
-      it != chunks.rend(); ++it) {
-        /* Calculate positions of bordering chunks. */
-        position border_pos[4];
-        border_pos[0] = it->first;
-        border_pos[0].first--;  // North
-        border_pos[1] = it->first;
-        border_pos[1].second--; // East
-        border_pos[2] = it->first;
-        border_pos[2].first++;  // South
-        border_pos[3] = it->first;
-        border_pos[3].second++; // West
-
-        /* Wait for the chunk's final requirement to load. */
-        chunkmap::iterator reqit;
-        chunkmap::iterator reqwait = it.base();
-        reqwait--;
-        if ((reqit = chunks.find(border_pos[1])) != chunks.end()) {
-          /* East chunk exists. */
-          reqwait = reqit;
-        }
-        if ((reqit = chunks.find(border_pos[0])) != chunks.end()) {
-          /* North chunk exists. */
-          reqwait = reqit;
-        }
-        {
-          Chunk* chunk;
-#pragma omp critical(chunks)
-          chunk = reqwait->second.second;
-          while (chunk == 0) {
-            /* Give up a timeslice. */
-            yield();
+      /* Decode files as they are read. */
+      while (decoded < (int)files.size()) {
+        int ready;
+#pragma omp critical(files)
+        ready = files_read;
+
+        /* Stay within the memory limit, unless the renderer is
+           waiting for the chunks. Without OpenMP the sections run one
+           after another, so the renderer can't free anything until
+           every file is decoded. */
+        int allowed = ready;
+#ifdef _OPENMP
 #pragma omp critical(chunks)
-            chunk = reqwait->second.second;
+        {
+          allowed = decoded;
+          size_t room = (resident < max_resident) ?
+            max_resident - resident : 0;
+          while (allowed < ready &&
+                 (room > 0 || plan.first_use[allowed] <= rendering)) {
+            if (room > 0)
+              room--;
+            allowed++;
           }
         }
+#endif
 
-        /* Chunks are loaded. Get pointers. */
-        Renderer::chunkbox chunkbox = {it->second.second, 0, 0, 0, 0};
-        /* North */
-        if ((reqit = chunks.find(border_pos[0])) != chunks.end()) {
-          chunkbox.north = reqit->second.second;
+        if (allowed == decoded) {
+          /* Give up a timeslice. */
+          yield();
+          continue;
         }
-        /* East */
-        if ((reqit = chunks.find(border_pos[1])) != chunks.end()) {
-          chunkbox.east = reqit->second.second;
+
+#pragma omp parallel for schedule(dynamic)
+        for (int i = decoded; i < allowed; i++) {
+          chunkmap::const_iterator it = plan.loads[i];
+          position pos = mirrored(it->first, mirror);
+          Chunk* load;
+          try {
+            if (!files[i].error.empty()) {
+              throw std::runtime_error(files[i].error + ": " + it->second);
+            }
+            load = new Chunk(files[i].data, it->second, pos);
+          } catch (std::exception& e) {
+#pragma omp critical(messages)
+            {
+              std::cerr << "Failed to load chunk "
+                        << pos.second << "x" << pos.first
+                        << std::endl;
+              debug << e.what() << std::endl;
+            }
+            load = new Chunk(pos);
+          }
+          Loader::buffer().swap(files[i].data);
+#pragma omp critical(chunks)
+          {
+            slots[i] = load;
+            resident++;
+            resident_bytes += load->memory();
+            if (resident > peak)
+              peak = resident;
+            if (resident_bytes > peak_bytes)
+              peak_bytes = resident_bytes;
+          }
         }
-        /* South */
-        if ((reqit = chunks.find(border_pos[2])) != chunks.end()) {
-          chunkbox.south = reqit->second.second;
+#pragma omp critical(files)
+        decoded = allowed;
+      }
+    }
+
+#pragma omp section
+    {
+      /* Render loaded chunks. Renderers draw separate images, so each
+         walks the steps on its own, in order. A team of workers lives
+         through the pass, and each worker takes the renderer furthest
+         behind whose next chunk is loaded, and draws a run of steps
+         with it. A step's chunks are freed once every renderer is past
+         it. */
+      std::vector<Renderer*> maps(renderers.begin(), renderers.end());
+      int steps = plan.steps.size();
+      std::vector<int> next(maps.size(), 0);     // Next step of each map.
+      std::vector<bool> taken(maps.size(), false);
+      int behind = 0;                            // Lowest of next.
+      std::vector<int> step_quality(steps, -1);
+      std::vector<double> step_cost(steps, 0.0); // Seconds drawing.
+      double idle = 0;                           // Seconds waiting.
+
+      int workers = maps.size();
+#ifdef _OPENMP
+      if (workers > omp_get_max_threads())
+        workers = omp_get_max_threads();
+#endif
+
+#pragma omp parallel num_threads(workers) if(workers > 1)
+      for (;;) {
+        /* Take the renderer furthest behind that can go on. */
+        int chosen = -1;
+        bool done;
+#pragma omp critical(chunks)
+        {
+          done = (behind == steps);
+          for (size_t m = 0; m < maps.size(); m++) {
+            if (taken[m] || next[m] == steps ||
+                (chosen >= 0 && next[m] >= next[chosen]))
+              continue;
+            const int* need = &plan.steps[next[m]].center;
+            bool loaded = true;
+            for (int i = 0; i < 5 && loaded; i++) {
+              loaded = (need[i] < 0 || slots[need[i]] != 0);
+            }
+            if (loaded)
+              chosen = m;
+          }
+          if (chosen >= 0)
+            taken[chosen] = true;
         }
-        /* West */
-        if ((reqit = chunks.find(border_pos[3])) != chunks.end()) {
-          chunkbox.west = reqit->second.second;
+        if (done)
+          break;
+        if (chosen < 0) {
+          /* Give up a timeslice. */
+          std::chrono::steady_clock::time_point waiting =
+            std::chrono::steady_clock::now();
+          yield();
+          std::chrono::duration<double> waited =
+            std::chrono::steady_clock::now() - waiting;
+#pragma omp critical(chunks)
+          idle += waited.count();
+          continue;
         }
 
-        /* We have a chunk. Try to render it. */
-        for (list<Renderer*>::iterator renderer = renderers.begin();
-             renderer != renderers.end(); ++renderer) {
+        /* Draw steps while their chunks are loaded. */
+        Renderer* map = maps[chosen];
+        const Renderer::regionopt& area = map->get_recipe().area;
+        int step = next[chosen];
+        for (int run = 0; run < render_run && step < steps; run++) {
+          const schedule::step& needs = plan.steps[step];
+          int quality;
+          bool loaded = true;
+#pragma omp critical(chunks)
+          {
+            const int* need = &needs.center;
+            for (int i = 0; i < 5 && loaded; i++) {
+              loaded = (need[i] < 0 || slots[need[i]] != 0);
+            }
+            /* Every map draws a chunk in the same quality, chosen by
+               the first to reach it. */
+            if (loaded && step_quality[step] < 0)
+              step_quality[step] = pace.quality();
+            quality = step_quality[step];
+          }
+          if (!loaded)
+            break;
+
+          /* A renderer doesn't see neighbours outside its region, just
+             as if only the region had been loaded. Neighbours swap
+             places along the axes the map is mirrored along. */
+          position pos = mirrored(plan.loads[needs.center]->first, mirror);
+          if (!area.second.empty() && !area.first.contains(pos)) {
+            step++;
+            continue;
+          }
+          Renderer::chunkbox box = {slots[needs.center], 0, 0, 0, 0};
+          if (needs.north >= 0) box.north = slots[needs.north];
+          if (needs.east >= 0)  box.east = slots[needs.east];
+          if (needs.south >= 0) box.south = slots[needs.south];
+          if (needs.west >= 0)  box.west = slots[needs.west];
+          if (mirror & MIRROR_X)
+            std::swap(box.north, box.south);
+          if (mirror & MIRROR_Z)
+            std::swap(box.east, box.west);
+          if (!area.second.empty()) {
+            if (!area.first.contains(position(pos.first - 1, pos.second)))
+              box.north = 0;
+            if (!area.first.contains(position(pos.first, pos.second - 1)))
+              box.east = 0;
+            if (!area.first.contains(position(pos.first + 1, pos.second)))
+              box.south = 0;
+            if (!area.first.contains(position(pos.first, pos.second + 1)))
+              box.west = 0;
+          }
+
+          /* Draw the chunk in the quality that keeps to the deadline. */
+          std::chrono::steady_clock::time_point drawing =
+            std::chrono::steady_clock::now();
+          map->set_quality(Renderer::quality(quality));
           try {
-            (*renderer)->render(chunkbox);
+            map->render(box);
           } catch (std::exception& e) {
-            std::cerr << "Failed to render chunk "
-                      << it->first.second << "x"
-                      << it->first.first << std::endl;
-            debug << e.what() << std::endl;
+#pragma omp critical(messages)
+            {
+              std::cerr << "Failed to render chunk "
+                        << pos.second << "x" << pos.first << std::endl;
+              debug << e.what() << std::endl;
+            }
           }
+          std::chrono::duration<double> drawn =
+            std::chrono::steady_clock::now() - drawing;
+#pragma omp critical(chunks)
+          step_cost[step] += drawn.count();
+          step++;
         }
 
-        /* Delete chunks that will no longer be needed. */
-        while (((deleter->first.first == it->first.first + 1) &&
-                deleter->first.second >= it->first.second) ||
-               (deleter->first.first > it->first.first + 1)) {
-          delete deleter->second.second;
-          deleter->second.second = 0;
-          ++deleter;
+        /* Hand the renderer back. Steps every renderer is past are
+           done: follow their cost, and delete chunks that will no
+           longer be needed. */
+#pragma omp critical(chunks)
+        {
+          next[chosen] = step;
+          taken[chosen] = false;
+          int lowest = *std::min_element(next.begin(), next.end());
+          for (; behind < lowest; behind++) {
+            int quality = step_quality[behind];
+            if (quality < 0)
+              quality = pace.quality();
+            pace.rendered(quality, step_cost[behind] / workers,
+                          idle / workers);
+            idle = 0;
+
+            const std::vector<int>& frees = plan.frees[behind];
+            for (size_t i = 0; i < frees.size(); i++) {
+              resident--;
+              resident_bytes -= slots[frees[i]]->memory();
+              delete slots[frees[i]];
+              slots[frees[i]] = 0;
+            }
+          }
+          rendering = behind;
         }
       }
     }
   }
 
-  /* We are done. Delete the rest of the chunks from memory. */
-  while (deleter != chunks.rend()) {
-    delete deleter->second.second;
-    deleter->second.second = 0;
-    ++deleter;
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  verbose << "Rendered " << plan.steps.size() << " chunks in "
+          << elapsed.count() << " seconds." << std::endl;
+  verbose << "Loaded " << plan.loads.size() << " chunks ("
+          << plan.loads.size() - source.size() << " re-read)." << std::endl;
+  verbose << "Peak residency: " << peak << " chunks, "
+          << peak_bytes / 1024 << " KiB." << std::endl;
+}
+
+/* Decide the order the chunks in source are loaded, rendered and
+   freed in. Chunks are rendered in reverse map order, in bands of
+   band_width along the z axis, or along a space-filling curve. A band
+   width of 0 renders whole rows at once. */
+void Level::make_schedule(schedule& plan, const chunkmap& source,
+                          int band_width, traversal curve) const {
+  plan.band_width = band_width;
+  plan.loads.clear();
+  plan.steps.clear();
+  plan.frees.clear();
+  plan.first_use.clear();
+  plan.peak = 0;
+
+  /* Bounding box of the chunks to render. */
+  position area_top_right = source.begin()->first;
+  position area_bottom_left = area_top_right;
+
+  /* Reverse map order, sorted by band. The sort is stable, so each
+     band is still walked in reverse map order. */
+  std::vector<chunkmap::const_iterator> order;
+  for (chunkmap::const_iterator it = source.begin(); it != source.end();
+       ++it) {
+    const position& pos = it->first;
+    if (pos.first < area_top_right.first)
+      area_top_right.first = pos.first;
+    if (pos.second < area_top_right.second)
+      area_top_right.second = pos.second;
+    if (pos.first > area_bottom_left.first)
+      area_bottom_left.first = pos.first;
+    if (pos.second > area_bottom_left.second)
+      area_bottom_left.second = pos.second;
+    order.push_back(it);
+  }
+  std::reverse(order.begin(), order.end());
+  if (curve != ROWS) {
+    std::sort(order.begin(), order.end(),
+              curve_order(curve, area_top_right, area_bottom_left));
+  } else if (band_width > 0) {
+    std::stable_sort(order.begin(), order.end(),
+                     band_order(area_bottom_left.second, band_width));
+  }
+
+  /* The load currently holding each chunk, and the band it was
+     loaded for. */
+  std::map<position, std::pair<int, int> > current;
+  std::vector<int> last_use;
+
+  for (size_t s = 0; s < order.size(); s++) {
+    const position& pos = order[s]->first;
+    int band = band_order(area_bottom_left.second, band_width).band(pos);
+
+    /* The chunk and its neighbours. */
+    position need_pos[5] = {pos, pos, pos, pos, pos};
+    need_pos[1].first--;  // North
+    need_pos[2].second--; // East
+    need_pos[3].first++;  // South
+    need_pos[4].second++; // West
+
+    schedule::step step;
+    int* need = &step.center;
+    for (int i = 0; i < 5; i++) {
+      need[i] = -1;
+      chunkmap::const_iterator found = source.find(need_pos[i]);
+      if (found == source.end())
+        continue;
+
+      /* Load the chunk, unless it is already loaded for this band. */
+      std::map<position, std::pair<int, int> >::iterator loaded =
+        current.find(need_pos[i]);
+      if (loaded == current.end() || loaded->second.first != band) {
+        current[need_pos[i]] = std::pair<int, int>(band, plan.loads.size());
+        plan.loads.push_back(found);
+        plan.first_use.push_back(s);
+        last_use.push_back(s);
+      }
+      need[i] = current[need_pos[i]].second;
+      last_use[need[i]] = s;
+    }
+    plan.steps.push_back(step);
   }
 
-  /* Finalise all renderers. */
-  for (list<Renderer*>::iterator renderer = renderers.begin();
-       renderer != renderers.end(); ++renderer) {
-    (*renderer)->finalise();
+  /* Free each load after its last use. */
+  plan.frees.resize(plan.steps.size());
+  for (size_t i = 0; i < last_use.size(); i++) {
+    plan.frees[last_use[i]].push_back(i);
   }
 
-  verbose << "Loaded " << chunks.size() << " chunks." << std::endl;
+  /* Find the largest number of chunks needed in memory at once. */
+  size_t resident = 0;
+  size_t load = 0;
+  for (size_t s = 0; s < plan.steps.size(); s++) {
+    while (load < plan.first_use.size() && plan.first_use[load] <= (int)s) {
+      resident++;
+      load++;
+    }
+    if (resident > plan.peak)
+      plan.peak = resident;
+    resident -= plan.frees[s].size();
+  }
+}
+
+/* Set up a curve covering the bounding box. */
+Level::curve_order::curve_order(traversal curve, const position& top_right,
+                                const position& bottom_left)
+  : curve(curve), corner(bottom_left), side(1) {
+  /* The curve covers a square with a power of two side. */
+  while (side <= bottom_left.first - top_right.first ||
+         side <= bottom_left.second - top_right.second) {
+    side *= 2;
+  }
+}
+
+/* Distance along the curve. */
+unsigned long long Level::curve_order::key(const position& pos) const {
+  unsigned long long u = corner.first - pos.first;
+  unsigned long long v = corner.second - pos.second;
+  unsigned long long result = 0;
+
+  if (curve == ZORDER) {
+    /* Interleave the bits of u and v. */
+    for (int bit = 0; (1 << bit) < side; bit++) {
+      result |= ((u >> bit) & 1) << (2 * bit + 1);
+      result |= ((v >> bit) & 1) << (2 * bit);
+    }
+  } else {
+    /* Hilbert curve, one quadrant at a time. */
+    for (unsigned long long s = side / 2; s > 0; s /= 2) {
+      unsigned long long ru = (u & s) ? 1 : 0;
+      unsigned long long rv = (v & s) ? 1 : 0;
+      result += s * s * ((3 * ru) ^ rv);
+
+      /* Rotate the quadrant. */
+      if (rv == 0) {
+        if (ru == 1) {
+          u = side - 1 - u;
+          v = side - 1 - v;
+        }
+        std::swap(u, v);
+      }
+    }
+  }
+
+  return result;
 }
 
 /* Update bounding box to include pos. */
@@ -346,6 +1249,22 @@ std::string Level::inttobase36(int i, bool mod64) {
 std::list<Level::position> Level::chunk_list(const std::string& geometry) {
   std::list<position> result;
 
+  position top_right, bottom_left;
+  chunk_bounds(geometry, top_right, bottom_left);
+
+  /* Fill chunk list. */
+  for (int xx = top_right.first; xx <= bottom_left.first; xx++) {
+    for (int zz = top_right.second; zz <= bottom_left.second; zz++) {
+      result.push_back({xx, zz});
+    }
+  }
+
+  return result;
+}
+
+/* Find the corners of the rectangle in a geometry string. */
+void Level::chunk_bounds(const std::string& geometry, position& top_right,
+                         position& bottom_left) {
   int width, height, west, south;
 
   size_t dX = geometry.find_first_of("xX");
@@ -404,12 +1323,6 @@ std::list<Level::position> Level::chunk_list(const std::string& geometry) {
     }
   }
 
-  /* Fill chunk list. */
-  for (int xx = 0; xx < height; xx++) {
-    for (int zz = 0; zz < width; zz++) {
-      result.push_back({xx + south, zz + west});
-    }
-  }
-
-  return result;
+  top_right = position(south, west);
+  bottom_left = position(south + height - 1, west + width - 1);
 }
@@ -5,12 +5,14 @@
 #include <list>
 #include <utility>
 #include <map>
-#include <utility>
+#include <vector>
+#include <chrono>
 
 #include "pvector.hpp"
 
 class Renderer;
 class Chunk;
+class Loader;
 
 /*
  * This class loads a level from drive, either in it's entirety or
@@ -21,32 +23,180 @@ public:
   /* Chunk positions given as x,z. */
   typedef std::pair<int, int> position;
 
+  /* Orders chunks can be rendered in. */
+  enum traversal {
+    ROWS,    // Row by row in reverse map order, or in bands of rows.
+    ZORDER,  // Along a Z-order (Morton) curve.
+    HILBERT  // Along a Hilbert curve.
+  };
+
   /* Generate chunk list from geometry string. */
   static std::list<position> chunk_list(const std::string& geometry);
 
+  /* Find the corners of the rectangle given by a geometry string. */
+  static void chunk_bounds(const std::string& geometry,
+                           position& top_right, position& bottom_left);
+
   /* Constructors. */
   /* Find all chunk files. */
   Level(const std::string& path);
   /* Find requested chunk files. */
   Level(const std::string& path,
         const std::list<position>& intersect);
-  /* Clear chunk map. */
-  ~Level();
 
-  /* Load files while rendering, clear data from memory continuously. */
+  /* Find chunks lying far away from the rest of the map, and warn
+     about them. If exclude is set, those that are empty or not
+     populated are left out of the map. Files are read through loader,
+     if given. */
+  void prefilter(bool exclude);
+  void prefilter(bool exclude, Loader& loader);
+
+  /* Does any chunk lie within the rectangle with these corners? */
+  bool has_chunks(const position& top_right,
+                  const position& bottom_left) const;
+
+  /* Limit the memory used by decoded chunks while rendering. Zero
+     means no limit. Limits too small to render with are raised, with
+     a warning. */
+  void set_memory_limit(size_t bytes);
+
+  /* Choose the order chunks are rendered in. */
+  void set_traversal(traversal order) { this->order = order; };
+
+  /* Give rendering a number of seconds to finish in, or zero for no
+     deadline. Chunks are drawn in lower quality while rendering falls
+     behind. */
+  void set_deadline(double seconds) { pace.seconds = seconds; };
+
+  /* Load files while rendering, clear data from memory continuously.
+     Levels rendered one after another may share a loader. */
   void render(Renderer& renderer);
   void render(std::list<Renderer*>& renderers);
+  void render(std::list<Renderer*>& renderers, Loader& loader);
 
 private:
   /* Levels cannot be copied or assigned. */
   Level(const Level&);
   Level& operator=(const Level&);
 
-  /* Map of chunk positions, chunks and file paths. */
-  typedef std::pair<std::string, Chunk*> datasource; // Chunk file and data.
-  typedef std::map<position, datasource> chunkmap; // A map of chunks in level.
+  /* Map of chunk positions and file paths. */
+  typedef std::map<position, std::string> chunkmap;
   chunkmap chunks;
 
+  /* Memory allowed for decoded chunks, or zero. */
+  size_t memory_limit;
+
+  /* Fewest chunks kept in memory, whatever the limit. */
+  static const size_t min_resident = 16;
+
+  /* Order chunks are rendered in. */
+  traversal order;
+
+  /* Keeps rendering on pace for the deadline. Each chunk gets the
+     best quality whose recent cost fits the time left for each chunk
+     still to come. The cost of drawing a chunk is followed for each
+     quality, and scaled along with the others. Time spent waiting for
+     chunks to load is added on, as lower quality can't save it. */
+  struct pacer {
+    double seconds;  // Seconds allowed, or zero.
+    std::chrono::steady_clock::time_point start;
+    size_t chunks_left;
+    std::vector<double> cost;  // Seconds per chunk, or zero if untried.
+    double waiting;            // Seconds per chunk spent waiting.
+    std::vector<int> chunks;   // Chunks rendered in each quality.
+    pacer() : seconds(0), chunks_left(0), waiting(0) {};
+    void begin(size_t chunks);
+    int quality() const;
+    void rendered(int quality, double drawing, double waiting);
+  };
+  pacer pace;
+
+  /* The order chunks are loaded, rendered and freed in. */
+  struct schedule {
+    /* Chunks to load, in the order they are first needed. A chunk is
+       loaded again if it is freed and needed later. */
+    std::vector<chunkmap::const_iterator> loads;
+    /* Step each load is first needed by. */
+    std::vector<int> first_use;
+
+    /* Chunks to render and their neighbours, as indices into loads,
+       or -1 where there is no chunk. */
+    struct step {
+      int center, north, east, south, west;
+    };
+    std::vector<step> steps;
+
+    /* Loads that can be freed after each step. */
+    std::vector<std::vector<int> > frees;
+
+    /* Band width used, and the most chunks needed in memory at once. */
+    int band_width;
+    size_t peak;
+  };
+  void make_schedule(schedule& plan, const chunkmap& source,
+                     int band_width, traversal curve = ROWS) const;
+
+  /* Passes over the map visit chunks in reverse map order, or in map
+     order along the axes they mirror the map along. */
+  enum mirror_axes {
+    MIRROR_X = 1,
+    MIRROR_Z = 2,
+    MIRRORS = 4  // Number of ways to mirror the map.
+  };
+
+  /* How a renderer would meet the chunks of a pass mirrored along
+     the given axes: the front of its map first, the back first,
+     either way, or not in an order it can be drawn in. */
+  enum pass_fit {
+    UNFIT,
+    EITHER,
+    FRONT_FIRST,
+    BACK_FIRST
+  };
+  static pass_fit fit(const Renderer& renderer, int mirror);
+
+  /* Load and render the chunks of source with the given renderers,
+     reading files through loader. Source holds the map mirrored along
+     the given axes. */
+  void render_pass(std::list<Renderer*>& renderers, const chunkmap& source,
+                   traversal curve, int mirror, Loader& loader);
+
+  /* Mirror a chunk position along the given axes. */
+  static position mirrored(const position& pos, int mirror) {
+    return position((mirror & MIRROR_X) ? -pos.first : pos.first,
+                    (mirror & MIRROR_Z) ? -pos.second : pos.second);
+  };
+
+  /* Sorts chunks into bands along the z axis, highest z first. */
+  struct band_order {
+    int zmax;
+    int width;
+    band_order(int zmax, int width) : zmax(zmax), width(width) {};
+    int band(const position& pos) const {
+      return (width > 0) ? (zmax - pos.second) / width : 0;
+    };
+    bool operator()(chunkmap::const_iterator a,
+                    chunkmap::const_iterator b) const {
+      return band(a->first) < band(b->first);
+    };
+  };
+
+  /* Sorts chunks along a space-filling curve, starting in the corner
+     with the highest x and z. Z-order keeps each row and column in
+     reverse map order. Hilbert order does not. */
+  struct curve_order {
+    traversal curve;
+    position corner;
+    int side;
+    curve_order(traversal curve, const position& top_right,
+                const position& bottom_left);
+    unsigned long long key(const position& pos) const;
+    bool operator()(chunkmap::const_iterator a,
+                    chunkmap::const_iterator b) const {
+      return key(a->first) < key(b->first);
+    };
+  };
+
   /* Bounding box. */
   position top_right;
   position bottom_left;
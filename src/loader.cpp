@@ -0,0 +1,388 @@
+#include "../config.h"
+#include "output.hpp"
+#include "loader.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+/* Use io_uring if the kernel headers know about it. */
+#if HAVE_LINUX_IO_URING_H && HAVE_SYS_SYSCALL_H && HAVE_SYS_MMAN_H
+  #include <linux/io_uring.h>
+  #include <sys/syscall.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+      defined(STATX_SIZE)
+    #define USE_IO_URING
+  #endif
+#endif
+
+#ifdef USE_IO_URING
+/* Shared memory rings of an io_uring instance. */
+struct Loader::ring {
+  int fd;
+
+  /* Submission queue. */
+  void* sq_ptr;
+  size_t sq_size;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned queued; // Entries added since the last submit.
+  unsigned unsubmitted; // Entries in the ring the kernel hasn't taken.
+
+  /* Completion queue. */
+  void* cq_ptr;
+  size_t cq_size;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  io_uring_cqe* cqes;
+
+  /* Get an empty submission entry. */
+  io_uring_sqe* next() {
+    unsigned tail = *sq_tail + queued;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    queued++;
+    return sqe;
+  }
+
+  /* Submit queued entries, and wait for at least one completion. The
+     kernel may take only some of the entries. The rest stay in the
+     ring and are submitted on the next call, which the callers make
+     while anything is outstanding. */
+  void submit() {
+    __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+    unsubmitted += queued;
+    queued = 0;
+    int taken = syscall(__NR_io_uring_enter, fd, unsubmitted, 1,
+                        IORING_ENTER_GETEVENTS, 0, 0);
+    if (taken >= 0) {
+      unsubmitted -= taken;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      throw std::runtime_error(std::string("io_uring_enter failed: ")
+                               + strerror(errno));
+    }
+  }
+
+  /* Pop a completion, if there is one. */
+  bool reap(io_uring_cqe& cqe) {
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+      return false;
+
+    cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+};
+
+/* What a completion belongs to. */
+enum uring_stage { OPEN = 0, STAT = 1, READ = 2, CLOSE = 3 };
+#else
+struct Loader::ring {};
+#endif
+
+/* Set up a loader able to read depth files at once. */
+Loader::Loader(unsigned int depth) : depth(depth ? depth : 1), uring(0) {
+#ifdef USE_IO_URING
+  /* Every file needs an open and a stat entry at the same time. */
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, this->depth * 2, &params);
+  if (fd < 0) {
+    debug << "io_uring unavailable (" << strerror(errno)
+          << "). Reading files with threads." << std::endl;
+    return;
+  }
+
+  ring* r = new ring();
+  r->fd = fd;
+  r->queued = 0;
+  r->unsubmitted = 0;
+  r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size)
+      r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+
+  /* Map the rings. */
+  r->sq_ptr = mmap(0, r->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ptr = r->sq_ptr;
+  } else {
+    r->cq_ptr = mmap(0, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  r->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  void* sqes = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+      sqes == MAP_FAILED) {
+    debug << "Couldn't map io_uring. Reading files with threads."
+          << std::endl;
+    if (r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);
+    if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+      munmap(r->cq_ptr, r->cq_size);
+    if (sqes != MAP_FAILED) munmap(sqes, r->sqes_size);
+    close(fd);
+    delete r;
+    return;
+  }
+
+  /* Find the ring members. */
+  char* sq = (char*)r->sq_ptr;
+  r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + params.sq_off.array);
+  r->sqes = (io_uring_sqe*)sqes;
+  char* cq = (char*)r->cq_ptr;
+  r->cq_head = (unsigned*)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  r->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  uring = r;
+#endif
+}
+
+/* Clean up. */
+Loader::~Loader() {
+#ifdef USE_IO_URING
+  if (uring) {
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ptr != uring->sq_ptr)
+      munmap(uring->cq_ptr, uring->cq_size);
+    munmap(uring->sq_ptr, uring->sq_size);
+    close(uring->fd);
+    delete uring;
+  }
+#endif
+}
+
+/* Name of the backend in use. */
+const char* Loader::backend() const {
+  return uring ? "io_uring" : "threads";
+}
+
+/* Read all files in the batch into memory. */
+void Loader::read(std::vector<request>& batch) {
+  if (uring) {
+    for (size_t first = 0; first < batch.size(); first += depth) {
+      size_t count = batch.size() - first;
+      if (count > depth)
+        count = depth;
+      read_uring(batch, first, count);
+    }
+  } else {
+    /* Blocking reads, spread over a team of threads. */
+    int size = batch.size();
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < size; i++) {
+      read_blocking(batch[i]);
+    }
+  }
+}
+
+/* Read part of a batch through the ring. */
+void Loader::read_uring(std::vector<request>& batch,
+                        size_t first, size_t count) {
+#ifdef USE_IO_URING
+  /* Progress of each file. */
+  struct progress {
+    int fd;
+    struct statx stat;
+    size_t done;
+    bool fallback;
+  };
+  std::vector<progress> state(count);
+
+  /* Queue an open and a stat for every file. */
+  for (size_t i = 0; i < count; i++) {
+    request& req = batch[first + i];
+    req.data.clear();
+    req.error.clear();
+    state[i].fd = -1;
+    state[i].done = 0;
+    state[i].fallback = false;
+
+    io_uring_sqe* sqe = uring->next();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req.path.c_str();
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = (i << 2) | OPEN;
+
+    sqe = uring->next();
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req.path.c_str();
+    sqe->len = STATX_SIZE;
+    sqe->off = (unsigned long)&state[i].stat;
+    sqe->user_data = (i << 2) | STAT;
+  }
+
+  /* Reap opens and stats. Queue reads for files that are ready. */
+  size_t outstanding = count * 2;
+  std::vector<bool> statted(count, false);
+  while (outstanding > 0) {
+    uring->submit();
+
+    io_uring_cqe cqe;
+    while (uring->reap(cqe)) {
+      outstanding--;
+      size_t i = cqe.user_data >> 2;
+      request& req = batch[first + i];
+
+      switch (cqe.user_data & 3) {
+      case OPEN:
+        if (cqe.res >= 0) {
+          state[i].fd = cqe.res;
+        } else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+          /* The kernel is too old for this opcode. */
+          state[i].fallback = true;
+        } else {
+          req.error = strerror(-cqe.res);
+        }
+        break;
+
+      case STAT:
+        if (cqe.res == 0) {
+          statted[i] = true;
+        } else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+          state[i].fallback = true;
+        } else if (req.error.empty()) {
+          req.error = strerror(-cqe.res);
+        }
+        break;
+      }
+    }
+  }
+
+  /* Queue a read of each opened file. */
+  outstanding = 0;
+  for (size_t i = 0; i < count; i++) {
+    request& req = batch[first + i];
+    if (state[i].fd < 0 || !statted[i] || state[i].fallback ||
+        !req.error.empty() || state[i].stat.stx_size == 0)
+      continue;
+
+    req.data.resize(state[i].stat.stx_size);
+    io_uring_sqe* sqe = uring->next();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = state[i].fd;
+    sqe->addr = (unsigned long)&req.data[0];
+    sqe->len = req.data.size();
+    sqe->off = 0;
+    sqe->user_data = (i << 2) | READ;
+    outstanding++;
+  }
+
+  /* Reap reads. Short reads are continued where they stopped. */
+  while (outstanding > 0) {
+    uring->submit();
+
+    io_uring_cqe cqe;
+    while (uring->reap(cqe)) {
+      outstanding--;
+      size_t i = cqe.user_data >> 2;
+      request& req = batch[first + i];
+
+      if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+        state[i].fallback = true;
+      } else if (cqe.res < 0) {
+        req.error = strerror(-cqe.res);
+      } else if (cqe.res == 0) {
+        /* The file shrunk since we stat'ed it. */
+        req.data.resize(state[i].done);
+      } else {
+        state[i].done += cqe.res;
+        if (state[i].done < req.data.size()) {
+          io_uring_sqe* sqe = uring->next();
+          sqe->opcode = IORING_OP_READ;
+          sqe->fd = state[i].fd;
+          sqe->addr = (unsigned long)&req.data[state[i].done];
+          sqe->len = req.data.size() - state[i].done;
+          sqe->off = state[i].done;
+          sqe->user_data = (i << 2) | READ;
+          outstanding++;
+        }
+      }
+    }
+  }
+
+  /* Close everything we opened. */
+  for (size_t i = 0; i < count; i++) {
+    if (state[i].fd >= 0) {
+      io_uring_sqe* sqe = uring->next();
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = state[i].fd;
+      sqe->user_data = (i << 2) | CLOSE;
+      outstanding++;
+    }
+  }
+  while (outstanding > 0) {
+    uring->submit();
+
+    io_uring_cqe cqe;
+    while (uring->reap(cqe)) {
+      outstanding--;
+      if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+        /* Old kernels cannot close through the ring. */
+        close(state[cqe.user_data >> 2].fd);
+      } else if (cqe.res < 0) {
+        /* The descriptor is released anyway, and its number may
+           already belong to another thread's file. */
+#pragma omp critical(messages)
+        debug << "Closing " << batch[first + (cqe.user_data >> 2)].path
+              << " failed: " << strerror(-cqe.res) << std::endl;
+      }
+    }
+  }
+
+  /* Anything the ring couldn't handle is read the old way. */
+  for (size_t i = 0; i < count; i++) {
+    if (state[i].fallback) {
+      read_blocking(batch[first + i]);
+    } else if (!batch[first + i].error.empty()) {
+      batch[first + i].data.clear();
+    }
+  }
+#endif
+}
+
+/* Read a file with blocking calls. */
+void Loader::read_blocking(request& req) {
+  req.data.clear();
+  req.error.clear();
+
+  FILE* file = fopen(req.path.c_str(), "rb");
+  if (!file) {
+    req.error = strerror(errno);
+    return;
+  }
+
+  unsigned char block[16384];
+  size_t got;
+  while ((got = fread(block, 1, sizeof(block), file)) > 0) {
+    req.data.insert(req.data.end(), block, block + got);
+  }
+  if (ferror(file)) {
+    req.error = "Read error";
+    req.data.clear();
+  }
+
+  fclose(file);
+}
@@ -0,0 +1,56 @@
+#ifndef H_LOADER
+#define H_LOADER
+
+#include <string>
+#include <vector>
+
+/*
+ * Reads whole files into memory, many at a time. Where the kernel
+ * supports io_uring, the opens, stats and reads of a batch are
+ * submitted together. Otherwise, a pool of threads does blocking
+ * reads.
+ */
+class Loader {
+public:
+  typedef std::vector<unsigned char> buffer;
+
+  /* A file to read, and the result of reading it. */
+  struct request {
+    std::string path;  // File to read.
+    buffer data;       // File contents.
+    std::string error; // Empty if the read succeeded.
+  };
+
+  /* Set up a loader able to read depth files at once. */
+  Loader(unsigned int depth = 256);
+
+  /* Clean up. */
+  ~Loader();
+
+  /* Read all files in the batch into memory. Blocks until all of them
+     are done or have failed. Large batches are split as needed. */
+  void read(std::vector<request>& batch);
+
+  /* Name of the backend in use. */
+  const char* backend() const;
+
+private:
+  /* Loaders cannot be copied or assigned. */
+  Loader(const Loader&);
+  Loader& operator=(const Loader&);
+
+  /* Maximum number of files in flight. */
+  unsigned int depth;
+
+  /* Kernel ring, or 0 if we are using the thread pool. */
+  struct ring;
+  ring* uring;
+
+  /* Read part of a batch through the ring. */
+  void read_uring(std::vector<request>& batch, size_t first, size_t count);
+
+  /* Read a single file with blocking calls. */
+  static void read_blocking(request& req);
+};
+
+#endif
@@ -2,11 +2,13 @@
 #include <sstream>
 #include <string>
 #include <list>
+#include <vector>
 #include <stdexcept>
 
 #include "../config.h"
 
 #include "level.hpp"
+#include "loader.hpp"
 #include "renderer.hpp"
 #include "render_contour.hpp"
 #include "image.hpp"
@@ -14,10 +16,255 @@
 #include "options.hpp"
 #include "output.hpp"
 
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+/* Yielding some cpu time to other threads. */
+#ifdef HAVE_WINDOWS_H
+  #include <windows.h>
+  #define yield() sleep(0)
+#elif HAVE_UNISTD_H
+  #include <unistd.h>
+  #define yield() usleep(10)
+#else
+  #define yield()
+#endif
+
 using std::cerr;
 using std::string;
 using std::list;
 
+/*
+ * Options that apply to every world being rendered.
+ */
+struct settings {
+  /* Chunk intersect list. */
+  list<Level::position> chunks;
+
+  /* Memory allowed for decoded chunks. Zero means no limit. */
+  size_t memory_limit;
+
+  /* Order to render chunks in. */
+  Level::traversal order;
+
+  /* Seconds rendering each world may take. Zero means no deadline. */
+  int deadline;
+
+  /* Look for outlying chunks, and whether to leave them out. */
+  bool prefilter;
+  bool exclude_outliers;
+};
+
+/*
+ * Render a world to memory, reading files through loader. Returns the
+ * finished renderers, which the caller must save and delete. Throws if
+ * anything fails.
+ */
+static Renderer::RenderList render_world(const string& worldpath,
+                                         const list<string>& renderstrs,
+                                         const settings& set,
+                                         Loader& loader) {
+  /* Generate the requested renderers. */
+  Renderer::RenderList renderers;
+  try {
+    for (list<string>::const_iterator str = renderstrs.begin();
+         str != renderstrs.end(); ++ str) {
+      renderers.splice(renderers.begin(), Renderer::make_renderers(*str));
+    }
+
+    /* Make sure there is at least one renderer.*/
+    if (renderers.size() == 0) {
+      throw std::runtime_error("No outputs specified.");
+    }
+
+    /* Prepare the level (create chunk map). */
+    verbose << "Finding files in " << worldpath << std::endl;
+    Level* level;
+    if (set.chunks.empty()) {
+      level = new Level(worldpath);
+    } else {
+      level = new Level(worldpath, set.chunks);
+    }
+    if (set.prefilter) {
+      level->prefilter(set.exclude_outliers, loader);
+    }
+
+    /* Leave out maps of regions holding no chunks. */
+    for (Renderer::RenderList::iterator it = renderers.begin();
+         it != renderers.end();) {
+      const Renderer::regionopt& area = (*it)->get_recipe().area;
+      if (area.second.empty() ||
+          level->has_chunks(area.first.top_right, area.first.bottom_left)) {
+        ++it;
+        continue;
+      }
+      std::cerr << "Warning: No chunks found for " << area.second
+                << ". Skipping " << (*it)->get_filename() << "."
+                << std::endl;
+      delete *it;
+      it = renderers.erase(it);
+    }
+    if (renderers.empty()) {
+      delete level;
+      throw std::runtime_error("No chunks found for any map.");
+    }
+
+    level->set_memory_limit(set.memory_limit);
+    level->set_traversal(set.order);
+    level->set_deadline(set.deadline);
+
+    /* Render to memory. */
+    verbose << "Rendering..." << std::endl;
+    try {
+      level->render(renderers, loader);
+    } catch (std::exception& e) {
+      delete level;
+      throw std::runtime_error(string("Rendering failed: ") + e.what());
+    }
+    delete level;
+
+  } catch (std::exception& e) {
+    while (!renderers.empty()) {
+      delete renderers.front();
+      renderers.pop_front();
+    }
+    throw;
+  }
+
+  return renderers;
+}
+
+/*
+ * Save and delete renderers. Images are written in parallel. Returns
+ * false if any of them failed.
+ */
+static bool save_all(Renderer::RenderList& renderers) {
+  std::vector<Renderer*> outputs(renderers.begin(), renderers.end());
+  renderers.clear();
+
+  bool all_ok = true;
+#pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < (int)outputs.size(); i++) {
+    try {
+      outputs[i]->save();
+    } catch (std::exception& e) {
+#pragma omp critical(messages)
+      {
+        std::cerr << "Failed to save rendering: " << e.what() << std::endl;
+        all_ok = false;
+      }
+    }
+
+    /* Delete the renderer, just to be nice. */
+    delete outputs[i];
+  }
+
+  return all_ok;
+}
+
+/*
+ * Render every world in a job list. Each world is scanned, decoded and
+ * rendered while the images of the previous one are written to disk.
+ * Rendering waits while a world is waiting to be written, so no more
+ * than three worlds of images are held at once.
+ */
+static bool render_batch(const list<job>& jobs, const settings& set) {
+  /* Rendered worlds allowed to wait for writing. */
+  const size_t max_waiting = 1;
+
+  /* Rendered worlds waiting to be written, and whether more will come. */
+  list<Renderer::RenderList> finished;
+  bool rendering = true;
+  bool all_ok = true;
+
+#ifdef _OPENMP
+  /* Rendering and writing each run a team of threads of their own. */
+  if (omp_get_max_active_levels() < 4)
+    omp_set_max_active_levels(4);
+#endif
+
+#pragma omp parallel sections num_threads(2)
+  {
+#pragma omp section
+    {
+      /* Render worlds one after another, all reading through one
+         loader. */
+      Loader loader;
+      for (list<job>::const_iterator it = jobs.begin(); it != jobs.end();
+           ++it) {
+        /* Don't get ahead of writing. */
+#ifdef _OPENMP
+        bool wait = true;
+        while (wait) {
+#pragma omp critical(finished)
+          wait = finished.size() >= max_waiting;
+          if (wait)
+            yield();
+        }
+#else
+        /* The sections run one after the other, so write the worlds
+           waiting here. */
+        while (finished.size() >= max_waiting) {
+          if (!save_all(finished.front()))
+            all_ok = false;
+          finished.pop_front();
+        }
+#endif
+
+#pragma omp critical(messages)
+        verbose << "Rendering " << it->first << std::endl;
+        try {
+          Renderer::RenderList renderers =
+            render_world(it->first, it->second, set, loader);
+#pragma omp critical(finished)
+          finished.push_back(renderers);
+        } catch (std::exception& e) {
+#pragma omp critical(messages)
+          {
+            cerr << it->first << ": " << e.what() << std::endl;
+            all_ok = false;
+          }
+        }
+      }
+#pragma omp critical(finished)
+      rendering = false;
+    }
+
+#pragma omp section
+    {
+      /* Write images of finished worlds as they come in. */
+      bool more = true;
+      while (more) {
+        Renderer::RenderList renderers;
+#pragma omp critical(finished)
+        {
+          if (!finished.empty()) {
+            renderers.swap(finished.front());
+            finished.pop_front();
+          }
+          more = rendering || !finished.empty();
+        }
+
+        if (renderers.empty()) {
+          if (more) {
+            /* Nothing to do yet. */
+            yield();
+          }
+          continue;
+        }
+
+        if (!save_all(renderers)) {
+#pragma omp critical(messages)
+          all_ok = false;
+        }
+      }
+    }
+  }
+
+  return all_ok;
+}
+
 /*
  * Main function. Interpret arguments and get started.
  */
@@ -37,8 +284,17 @@ int main(int argc, char** argv) {
   /* Global options. */
   list<longopt> options;
 
-  /* Chunk intersect list. */
-  list<Level::position> chunks;
+  /* Options for every world rendered. */
+  settings set;
+  set.memory_limit = 0;
+  set.order = Level::ROWS;
+  set.deadline = 0;
+  set.prefilter = false;
+  set.exclude_outliers = false;
+
+  /* Worlds and renderspecs to render in batch mode. */
+  list<job> jobs;
+  bool batch = false;
 
   /* Get options and their arguments. */
   try {
@@ -102,14 +358,83 @@ int main(int argc, char** argv) {
     } else if (opt->first == "chunks") {
       /* Fill chunk intersection list. */
       try {
-        chunks = Level::chunk_list(opt->second);
+        set.chunks = Level::chunk_list(opt->second);
+      } catch (std::exception& e) {
+        cerr << e.what() << std::endl;
+        return 1;
+      }
+
+    } else if (opt->first == "memory-limit") {
+      /* Bound the memory used by decoded chunks. */
+      try {
+        set.memory_limit = stringtosize(opt->second);
+      } catch (std::runtime_error& e) {
+        cerr << "Invalid memory limit: " << opt->second << "\n";
+        return 1;
+      }
+
+    } else if (opt->first == "deadline") {
+      /* Keep to a deadline, in lower quality if needed. */
+      try {
+        set.deadline = stringtoint(opt->second);
+      } catch (std::runtime_error& e) {
+        set.deadline = 0;
+      }
+      if (set.deadline <= 0) {
+        cerr << "Invalid deadline: " << opt->second << "\n";
+        return 1;
+      }
+
+    } else if (opt->first == "order") {
+      /* Choose the order chunks are rendered in. */
+      if (opt->second == "rows") {
+        set.order = Level::ROWS;
+      } else if (opt->second == "zorder") {
+        set.order = Level::ZORDER;
+      } else if (opt->second == "hilbert") {
+        set.order = Level::HILBERT;
+      } else {
+        cerr << "Invalid order: " << opt->second << "\n";
+        return 1;
+      }
+
+    } else if (opt->first == "prefilter") {
+      /* Look for chunks far away from the rest of the map. */
+      set.prefilter = true;
+      if (opt->second == "warn") {
+        set.exclude_outliers = false;
+      } else if (opt->second == "exclude") {
+        set.exclude_outliers = true;
+      } else {
+        cerr << "Invalid prefilter mode: " << opt->second << "\n";
+        return 1;
+      }
+
+    } else if (opt->first == "batch") {
+      /* Read the list of worlds to render. */
+      try {
+        parse_jobs(opt->second, jobs);
       } catch (std::exception& e) {
         cerr << e.what() << std::endl;
         return 1;
       }
+      batch = true;
     }
   }
 
+  /* Batch mode takes its worlds and outputs from the job file. */
+  if (batch) {
+    if (!worldpath.empty() || !renderstrs.empty()) {
+      cerr << "Worlds and renderspecs cannot be given along with "
+           << "--batch. Put them in the job file.\n";
+      return 1;
+    }
+
+    bool all_ok = render_batch(jobs, set);
+    std::cerr << "Done." << std::endl;
+    return all_ok ? 0 : 1;
+  }
+
 
   /* Make sure a world was chosen. */
   if (worldpath.empty()) {
@@ -119,56 +444,21 @@ int main(int argc, char** argv) {
     return 1;;
   }
 
-  /* Generate the requested renderers. */
-  Renderer::RenderList renderers;
-  for (list<string>::iterator str = renderstrs.begin();
-       str != renderstrs.end(); ++ str) {
-    renderers.splice(renderers.begin(), Renderer::make_renderers(*str));
-  }
-
-  /* Make sure there is at least one renderer.*/
-  if (renderers.size() == 0) {
-    cerr << "No outputs specified.\n";
-    return 1;
-  }
-
-  /* Prepare the level (create chunk map). */
-  verbose << "Finding files in " << worldpath << std::endl;
-  Level* level;
-  if (chunks.empty()) {
-    level = new Level(worldpath);
-  } else {
-    level = new Level(worldpath, chunks);
-  }
-
   /* Render to memory. */
-  verbose << "Rendering..." << std::endl;
+  Renderer::RenderList renderers;
   try {
-    level->render(renderers);
+    Loader loader;
+    renderers = render_world(worldpath, renderstrs, set, loader);
   } catch (std::exception& e) {
-    cerr << "Rendering failed: " << e.what() << std::endl;
+    cerr << e.what() << std::endl;
     return 1;
   }
 
   /* Output the result. */
-  bool all_ok = true;
   verbose << "Finished reading. Writing images to disk." << std::endl;
-  Renderer::RenderList::iterator renderer = renderers.begin();
-  while (!renderers.empty()) {
-    try {
-      (*renderer)->save();
-    } catch (std::exception& e) {
-      std::cerr << "Failed to save rendering: " << e.what() << std::endl;
-      all_ok = false;
-    }
-
-    /* Delete the renderer, just to be nice. */
-    delete *renderer;
-    renderer = renderers.erase(renderer);
-  }
+  bool all_ok = save_all(renderers);
 
   /* Finished. */
-  delete level;
   std::cerr << "Done." << std::endl;
   if (all_ok)
     return 0;
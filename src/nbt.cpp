@@ -1,37 +1,58 @@
 #include "nbt.hpp"
 
+#include <cstdio>
 #include <stdexcept>
 using namespace NBT;
 
 /* Open and read file. */
 Parser::Parser(std::string filepath) {
   /* Open the file for reading. */
-  gzFile file = gzopen(filepath.c_str(), "rb");
-  if (file == Z_NULL) {
+  FILE* file = fopen(filepath.c_str(), "rb");
+  if (!file) {
     throw std::runtime_error(string("Couldn't open file ") + filepath);
   }
 
+  /* Read the whole file into memory. */
+  std::vector<unsigned char> compressed;
+  unsigned char block[16384];
+  size_t got;
+  while ((got = fread(block, 1, sizeof(block), file)) > 0) {
+    compressed.insert(compressed.end(), block, block + got);
+  }
+  bool failed = ferror(file);
+
+  /* Close the file. */
+  fclose(file);
+  if (failed) {
+    throw std::runtime_error(string("Couldn't read file ") + filepath);
+  }
+
+  Stream stream(compressed, filepath);
+  parse(stream, filepath);
+}
+
+/* Parse a compressed file that has already been read into memory. */
+Parser::Parser(const std::vector<unsigned char>& compressed,
+               const std::string& name) {
+  Stream stream(compressed, name);
+  parse(stream, name);
+}
+
+/* Read the root tag from an inflated stream. */
+void Parser::parse(Stream& stream, const std::string& name) {
   /* Read the file, tag by tag. */
   try {
-    int type = gzgetc(file);
+    int type = stream.getc();
     if (type != 10) {
       if (type == -1) {
-        int err;
-        throw std::runtime_error(gzerror(file, &err));
+        throw std::runtime_error("Unexpected end of NBT data.");
       }
       throw std::runtime_error(string("Root tag is not compound"));
     }
-    root.get(file, true);
+    root.get(stream, true);
   } catch (std::runtime_error& e) {
-    gzclose(file);
-    throw std::runtime_error(string(e.what()) + " in " + filepath);
-  } catch (std::exception& e) {
-    gzclose(file);
-    throw;
+    throw std::runtime_error(string(e.what()) + " in " + name);
   }
-
-  /* Close the file. */
-  gzclose(file);
 }
 
 /* Print structure of named tags. */
@@ -1,8 +1,8 @@
 #ifndef H_NBT
 #define H_NBT
 
-#include <zlib.h>
 #include <string>
+#include <vector>
 #include <ostream>
 
 #include "nbttags.hpp"
@@ -16,9 +16,16 @@ namespace NBT {
   private:
     TAG_Compound root;
 
+    /* Read the root tag from an inflated stream. */
+    void parse(Stream& stream, const std::string& name);
+
   public:
     /* Read filepath into memory. */
     Parser(std::string filepath);
+    /* Parse a compressed file that has already been read into
+       memory. The name is only used in error messages. */
+    Parser(const std::vector<unsigned char>& compressed,
+           const std::string& name);
     /* Create an empty dummy NBT. */
     Parser() {};
 
@@ -0,0 +1,96 @@
+#include "nbtstream.hpp"
+
+#include <zlib.h>
+#include <cstring>
+#include <stdexcept>
+
+using namespace NBT;
+
+/* Check for the magic bytes that start a gzip member. */
+static bool gzip_magic(const unsigned char* in, size_t length) {
+  return length >= 2 && in[0] == 0x1f && in[1] == 0x8b;
+}
+
+/* Inflate a gzip compressed buffer, or copy it as it is if it isn't
+   compressed, the same as gzread() would. */
+Stream::Stream(const std::vector<unsigned char>& compressed,
+               const std::string& name) : position(0) {
+  if (compressed.empty()) {
+    throw std::runtime_error(std::string("Empty file ") + name);
+  }
+
+  if (!gzip_magic(&compressed[0], compressed.size())) {
+    data = compressed;
+    return;
+  }
+
+  z_stream zs;
+  std::memset(&zs, 0, sizeof(zs));
+  /* 15 window bits, plus 16 to expect a gzip header. */
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    throw std::runtime_error(std::string("Couldn't initialise zlib for ")
+                             + name);
+  }
+
+  zs.next_in = const_cast<Bytef*>(&compressed[0]);
+  zs.avail_in = compressed.size();
+
+  /* Chunks usually inflate to about six times their size. */
+  data.resize(compressed.size() * 8);
+  size_t inflated = 0;
+  int status;
+  for (;;) {
+    if (inflated == data.size()) {
+      data.resize(data.size() * 2);
+    }
+    zs.next_out = &data[inflated];
+    zs.avail_out = data.size() - inflated;
+    status = inflate(&zs, Z_NO_FLUSH);
+    /* Counted here, since inflateReset() clears total_out. */
+    inflated = data.size() - zs.avail_out;
+    if (status == Z_STREAM_END) {
+      /* Another member may follow. Anything else after the end is
+         ignored, as gzread() does. */
+      if (!gzip_magic(zs.next_in, zs.avail_in))
+        break;
+      status = inflateReset(&zs);
+    }
+    if (status != Z_OK)
+      break;
+  }
+
+  data.resize(inflated);
+  inflateEnd(&zs);
+
+  if (status != Z_STREAM_END) {
+    throw std::runtime_error(std::string("Corrupt compressed data in ")
+                             + name);
+  }
+}
+
+/* Get the next byte, or -1 at the end of the stream. */
+int Stream::getc() {
+  if (position >= data.size())
+    return -1;
+
+  return data[position++];
+}
+
+/* Copy the next length bytes to dest. */
+void Stream::read(unsigned char* dest, size_t length) {
+  if (data.size() - position < length) {
+    throw std::runtime_error("Unexpected end of NBT data.");
+  }
+
+  std::memcpy(dest, &data[position], length);
+  position += length;
+}
+
+/* Skip the next length bytes. */
+void Stream::skip(size_t length) {
+  if (data.size() - position < length) {
+    throw std::runtime_error("Unexpected end of NBT data.");
+  }
+
+  position += length;
+}
@@ -0,0 +1,38 @@
+#ifndef H_NBTSTREAM
+#define H_NBTSTREAM
+
+#include <string>
+#include <vector>
+
+namespace NBT {
+
+  /*
+   * An inflated NBT file held in memory. The whole file is
+   * decompressed up front, so tags can be read without a call into
+   * zlib for every byte.
+   */
+  class Stream {
+  public:
+    /* Inflate a gzip compressed buffer, which may hold several
+       members, or take it as it is if it isn't compressed. The name is
+       only used in error messages. */
+    Stream(const std::vector<unsigned char>& compressed,
+           const std::string& name);
+
+    /* Get the next byte, or -1 at the end of the stream. */
+    int getc();
+
+    /* Copy the next length bytes to dest. Throws on a short read. */
+    void read(unsigned char* dest, size_t length);
+
+    /* Skip the next length bytes. Throws on a short read. */
+    void skip(size_t length);
+
+  private:
+    std::vector<unsigned char> data;
+    size_t position;
+  };
+
+}
+
+#endif
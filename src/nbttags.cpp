@@ -48,72 +48,68 @@ TAG* TAG::newtag(unsigned char type) {
   }
 }
 
+/* Get a byte from the stream, or throw at the end of it. */
+static unsigned char nextbyte(Stream& stream) {
+  int c = stream.getc();
+  if (c < 0) {
+    throw std::runtime_error("Unexpected end of NBT data.");
+  }
+  return c;
+}
+
 /* Type 1: A single signed byte. */
-void TAG_Byte::get(gzFile file, bool named) {
+void TAG_Byte::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
-  if ((payload = gzgetc(file)) < 0) {
-    int err;
-    throw std::runtime_error(gzerror(file, &err));
-  }
+  payload = nextbyte(stream);
 }
 
 /* Type 2: A signed short 16 bit. */
-void TAG_Short::get(gzFile file, bool named) {
+void TAG_Short::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
-  int big, small;
-  if ((big = gzgetc(file) < 0) ||
-      (small = gzgetc(file)) < 0) {
-    int err;
-    throw std::runtime_error(gzerror(file, &err));
-  }
+  int big = nextbyte(stream);
+  int small = nextbyte(stream);
 
   payload = (big << 8) + small;
 }
 
 /* Type 3: A signed short, 32 bit. */
-void TAG_Int::get(gzFile file, bool named) {
+void TAG_Int::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
   int data[4];
   for (int i = 0; i < 4; i++) {
-    if ((data[i]= gzgetc(file)) < 0) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
-    }
+    data[i] = nextbyte(stream);
   }
 
   payload = (data[0] << 24) + (data[1] << 16) + (data[2] << 8) + data[3];
 }
 
 /* Type 4: A signed long, 64 bit. */
-void TAG_Long::get(gzFile file, bool named) {
+void TAG_Long::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
 
   int data[8];
   for (int i = 0; i < 8; i++) {
-    if ((data[i]= gzgetc(file)) < 0) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
-    }
+    data[i] = nextbyte(stream);
   }
 
 
@@ -124,48 +120,36 @@ void TAG_Long::get(gzFile file, bool named) {
 }
 
 /* Type 5: A floating point value, 32 bit. */
-void TAG_Float::get(gzFile file, bool named) {
+void TAG_Float::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
-  int data[4];
-  for (int i = 0; i < 4; i++) {
-    if ((data[i]= gzgetc(file)) < 0) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
-    }
-  }
+  stream.skip(4);
 
   payload = 0; // TODO: Convert data[3..0] to float.
 }
 
 /* Type 6: A floating point value, 64 bit. */
-void TAG_Double::get(gzFile file, bool named) {
+void TAG_Double::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
-  int data[8];
-  for (int i = 0; i < 8; i++) {
-    if ((data[i]= gzgetc(file)) < 0) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
-    }
-  }
+  stream.skip(8);
 
   payload = 0; // TODO: Convert data[7..0] to double.
 }
 
 /* Type 7: An array of unformatted bytes. */
-void TAG_Byte_Array::get(gzFile file, bool named) {
+void TAG_Byte_Array::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
@@ -176,16 +160,18 @@ void TAG_Byte_Array::get(gzFile file, bool named) {
   }
 
   /* Get size of payload. */
-  TAG_Int len; len.get(file);
+  TAG_Int len; len.get(stream);
   length = len.payload;
 
   /* Load payload. */
   if (length > 0) {
     payload = new unsigned char[length];
-    for (int i = 0; i < length; i++) {
-      TAG_Byte data;
-      data.get(file);
-      payload[i] = data.payload;
+    try {
+      stream.read(payload, length);
+    } catch (std::exception& e) {
+      delete [] payload;
+      payload = 0;
+      throw;
     }
   }
 }
@@ -196,37 +182,30 @@ TAG_Byte_Array::~TAG_Byte_Array() {
 }
 
 /* Type 8: An array of bytes, UTF8. */
-void TAG_String::get(gzFile file, bool named) {
+void TAG_String::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
   /* Delete old payload and get length of new one. */
   payload = "";
   TAG_Short length;
-  length.get(file);
+  length.get(stream);
 
   /* Load payload into string. */
   if (length.payload > 0) {
-    char* data = new char[length.payload + 1];
-
-    if (gzgets(file, data, length.payload + 1) == Z_NULL) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
-    }
-
-    payload = data;
-    delete [] data;
+    payload.resize(length.payload);
+    stream.read((unsigned char*)&payload[0], length.payload);
   }
 }
 
 /* Type 9: A sequential list of single-type tags. */
-void TAG_List::get(gzFile file, bool named) {
+void TAG_List::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
@@ -241,16 +220,15 @@ void TAG_List::get(gzFile file, bool named) {
   }
 
   /* Get new header. */
-  TAG_Byte tagid;  tagid.get(file);
-  TAG_Int  len; len.get(file);
-  length = len.payload;
+  TAG_Byte tagid;  tagid.get(stream);
+  TAG_Int  len; len.get(stream);
 
   /* Load new payload. */
-  if (length > 0) {
-    payload = new TAG*[length];
-    for (int i = 0; i < length; i++) {
-      payload[i] = TAG::newtag(tagid.payload);
-      payload[i]->get(file);
+  if (len.payload > 0) {
+    payload = new TAG*[len.payload];
+    for (length = 0; length < len.payload; length++) {
+      payload[length] = TAG::newtag(tagid.payload);
+      payload[length]->get(stream);
     }
   }
 }
@@ -265,22 +243,21 @@ TAG_List::~TAG_List() {
 }
 
 /* Type 10: A sequential list of named tags. */
-void TAG_Compound::get(gzFile file, bool named) {
+void TAG_Compound::get(Stream& stream, bool named) {
   if (named) {
     TAG_String n;
-    n.get(file);
+    n.get(stream);
     name = n.payload;
   }
 
   int type;
-  while ((type = gzgetc(file)) != 0) {
+  while ((type = stream.getc()) != 0) {
     if (type == -1) {
-      int err;
-      throw std::runtime_error(gzerror(file, &err));
+      throw std::runtime_error("Unexpected end of NBT data.");
     }
     TAG* sub = newtag(type);
-    sub->get(file, true);
     payload.push_back(sub);
+    sub->get(stream, true);
   }
 }
 TAG_Compound::~TAG_Compound() {
@@ -4,7 +4,8 @@
 #include <ostream>
 #include <string>
 #include <list>
-#include <zlib.h>
+
+#include "nbtstream.hpp"
 
 using std::string;
 using std::list;
@@ -31,8 +32,8 @@ namespace NBT {
     /* A string for the tag type. */
     virtual string tagtype() = 0;
 
-    /* Read tag contents from file. */
-    virtual void get(gzFile file, bool named = false) = 0;
+    /* Read tag contents from stream. */
+    virtual void get(Stream& stream, bool named = false) = 0;
 
     /* Make destructor virtual. */
     virtual ~TAG() {};
@@ -42,7 +43,7 @@ namespace NBT {
   class TAG_End : public TAG {
   public:
     string tagtype() { return "TAG_End"; };
-    void get(gzFile file, bool named = false) {};
+    void get(Stream& stream, bool named = false) {};
   };
 
   /* Type 1: A single signed byte. */
@@ -50,7 +51,7 @@ namespace NBT {
   public:
     unsigned char payload;
     string tagtype() { return "TAG_Byte"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 2: A signed short 16 bit. */
@@ -58,7 +59,7 @@ namespace NBT {
   public:
     int payload;
     string tagtype() { return "TAG_Short"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 3: A signed short, 32 bit. */
@@ -66,7 +67,7 @@ namespace NBT {
   public:
     long payload;
     string tagtype() { return "TAG_Int"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 4: A signed long, 64 bit. */
@@ -74,7 +75,7 @@ namespace NBT {
   public:
     long long payload;
     string tagtype() { return "TAG_Long"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 5: A floating point value, 32 bit. */
@@ -82,7 +83,7 @@ namespace NBT {
   public:
     float payload;
     string tagtype() { return "TAG_Float"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 6: A floating point value, 64 bit. */
@@ -90,7 +91,7 @@ namespace NBT {
   public:
     double payload;
     string tagtype() { return "TAG_Double"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 7: An array of unformatted bytes. */
@@ -99,7 +100,7 @@ namespace NBT {
     int length;
     unsigned char* payload;
     string tagtype() { return "TAG_Byte_Array"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
 
     TAG_Byte_Array();
     ~TAG_Byte_Array();
@@ -110,7 +111,7 @@ namespace NBT {
   public:
     string payload;
     string tagtype() { return "TAG_String"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
   };
 
   /* Type 9: A sequential list of single-type tags. */
@@ -119,7 +120,7 @@ namespace NBT {
     int length;
     TAG** payload;
     string tagtype() { return "TAG_List"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
 
     TAG_List();
     ~TAG_List();
@@ -130,7 +131,7 @@ namespace NBT {
   public:
     list<TAG*> payload;
     string tagtype() { return "TAG_Compound"; };
-    void get(gzFile file, bool named = false);
+    void get(Stream& stream, bool named = false);
 
     /* Print named structure recursively. */
     void print_structure(std::ostream& out, int indent = 0);
@@ -1,6 +1,8 @@
 #include "options.hpp"
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <stdexcept>
 
 using std::cerr;
@@ -15,11 +17,30 @@ const struct option {
   string argname;
   string description;
 } valid_options[] = {
+  { 0, "deadline", true, "seconds", "Finish rendering each world within "
+                                   "seconds, drawing chunks without "
+                                   "lighting, transparency or full detail "
+                                   "while behind. Such chunks are listed "
+                                   "in the images."},
   { 0, "debug", false, "", "Enable debugging output."},
+  { 'b', "batch", true, "jobfile", "Render several worlds, one per line of "
+                                   "jobfile. Each line holds a world path "
+                                   "followed by renderspecs."},
   { 'c', "chunks", true, "dimensions", "Only render the chunks specified by "
                                        "dimensions (WxH or WxH+Z+X)." },
+  { 0, "memory-limit", true, "size", "Keep decoded chunks within size bytes "
+                                     "of memory (suffix K, M or G). Wide "
+                                     "maps are rendered in bands if needed."},
   { 'n', "number", true, "n", "The world number to render. This or -p must "
                               "be specified."},
+  { 0, "order", true, "order", "Render chunks in rows (the default), or "
+                               "along a zorder or hilbert curve. Curves "
+                               "keep neighbouring chunks close in time."},
+  { 0, "prefilter", true, "mode", "Look for chunks lying far away from the "
+                                 "rest of the map before rendering. Mode "
+                                 "warn reports them, exclude leaves out "
+                                 "those that are empty or not "
+                                 "populated."},
   { 'p', "path", true, "path", "The path of the world to render. This or -n "
                                "must be specified."},
   { 'v', "verbose", false, "", "Print more status information." },
@@ -67,13 +88,27 @@ void usage(const char* binary) {
        << "\tthe surface depending on height. This will enable you to see\n"
        << "\theight features on top-down maps without contour lines.\n";
   cerr << "  Angle keywords [%a]: (defaults to <topdown>)\n"
-       << "\t<oblique, topdown>. Oblique only works for cardinal directions\n"
-       << "\tin this alpha release.\n";
+       << "\t<oblique, topdown>. Oblique maps facing northwest or southeast\n"
+       << "\tneed a pass over the world of their own, unless every oblique\n"
+       << "\tmap faces one of those ways.\n";
+  cerr << "  Region keyword: (defaults to the whole map)\n"
+       << "\tchunks=<dimensions>, as for --chunks. Renders only these\n"
+       << "\tchunks. Maps with different regions share a single pass\n"
+       << "\tover the world, reading each chunk once.\n";
+  cerr << "  Scale keyword: (defaults to scale=1)\n"
+       << "\tscale=<N>, where N is 1, 2, 4, 8 or 16. Top-down maps draw\n"
+       << "\tone pixel for each N by N blocks, for quick overviews.\n";
+  cerr << "  Clip keywords: (defaults to maxy=127,miny=0)\n"
+       << "\tmaxy=<N> and miny=<N> draw only the blocks from height miny\n"
+       << "\tto maxy, as if the rest were air. Use maxy for cave levels\n"
+       << "\tand both for slices.\n";
   cerr << "  Special keywords: (defaults to nothing)\n"
-       << "\t<contour> draws contour lines on a transparent background.\n";
+       << "\t<contour> draws contour lines on a transparent background.\n"
+       << "\tdelta=<N> sets the height between lines (defaults to 5), and\n"
+       << "\toffset=<N> the height of one of them (defaults to 3).\n";
   cerr << "\n  Overlays can be added with all the same keywords except\n"
-       << "  rotation. The specials make good overlays, as they have\n"
-       << "  transparent backgrounds.\n";
+       << "  rotation, angle, region, scale and clip heights. The specials\n"
+       << "  make good overlays, as they have transparent backgrounds.\n";
 
   /* Describe multiples. */
   cerr << "\nMultiples:\n"
@@ -88,8 +123,13 @@ void usage(const char* binary) {
        << "\t" << binary << " -n2 map.png\n";
   cerr << "  Render four oblique maps of the area around spawn.:\n"
        << "\t" << binary << " -c15x15 -n2 map-%r.png:oblique,night,cardinal\n";
+  cerr << "  Render the whole world and a close-up of spawn in one go:\n"
+       << "\t" << binary << " -n2 world.png spawn.png:chunks=8x8\n";
   cerr << "  Render a map facing east with contour lines:\n"
        << "\t" << binary << " -n2 map.png:east:contour\n";
+  cerr << "  Render the worlds listed in jobs.txt, with lines such as\n"
+       << "  \"saves/World1 world1.png world1-%r.png:oblique,cardinal\":\n"
+       << "\t" << binary << " --batch=jobs.txt\n";
 }
 
 /*
@@ -191,3 +231,42 @@ void parse_options(int argc, char** argv,
     }
   }
 }
+
+/*
+ * Read a job file for batch mode.
+ */
+void parse_jobs(const std::string& filename, list<job>& jobs) {
+  std::ifstream file(filename.c_str());
+  if (!file) {
+    throw std::runtime_error(string("Couldn't open job file ") + filename);
+  }
+
+  string line;
+  int lineno = 0;
+  while (std::getline(file, line)) {
+    lineno++;
+    std::istringstream stream(line);
+    string world;
+    if (!(stream >> world) || world[0] == '#') {
+      /* Empty line or comment. */
+      continue;
+    }
+
+    job add(world, list<string>());
+    string renderspec;
+    while (stream >> renderspec) {
+      add.second.push_back(renderspec);
+    }
+    if (add.second.empty()) {
+      std::ostringstream error;
+      error << filename << ":" << lineno << ": No renderspecs for "
+            << world << ".";
+      throw std::runtime_error(error.str());
+    }
+    jobs.push_back(add);
+  }
+
+  if (jobs.empty()) {
+    throw std::runtime_error(string("No jobs in ") + filename);
+  }
+}
@@ -7,6 +7,9 @@
 /* Long options and their arguments. */
 typedef std::pair<std::string, std::string> longopt;
 
+/* A world path and the renderspecs to render it with. */
+typedef std::pair<std::string, std::list<std::string> > job;
+
 /*
  * Output usage help.
  */
@@ -20,4 +23,11 @@ void parse_options(int argc, char** argv,
                    std::list<std::string>& renderstrs,
                    std::list<longopt>& options);
 
+/*
+ * Read a job file for batch mode. Each line holds a world path
+ * followed by renderspecs, separated by whitespace. Empty lines and
+ * lines starting with # are ignored.
+ */
+void parse_jobs(const std::string& filename, std::list<job>& jobs);
+
 #endif
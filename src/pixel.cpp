@@ -1,26 +1,48 @@
 #include "pixel.hpp"
 
-/* Alpha blend another pixel underneath self. */
-void Pixel::blend_under(const Pixel& source) {
-  unsigned char nA = A + ((255-A)*source.A)/255;
-  A = (nA == 0) ? 0 : A * 255 / nA;
-  unsigned char sA = 255 - A;
-  R = (R * A + source.R * sA) / 255;
-  G = (G * A + source.G * sA) / 255;
-  B = (B * A + source.B * sA) / 255;
-  A = nA;
-}
+#include <algorithm>
 
-/* Alpha blend another pixel over self. */
-void Pixel::blend_over(const Pixel& source) {
-  unsigned char nA = source.A + ((255-source.A)*A)/255;
-  A = (nA == 0) ? 0 : source.A * 255 / nA;
-  unsigned char tA = 255 - A;
-  R = (R * tA + source.R * A) / 255;
-  G = (G * tA + source.G * A) / 255;
-  B = (B * tA + source.B * A) / 255;
-  A = nA;
-}
+/* Colour values lit by each light level. */
+unsigned char Pixel::scale[256][256];
+static struct scale_table {
+  scale_table() {
+    for (int value = 0; value < 256; value++) {
+      for (int colour = 0; colour < 256; colour++) {
+        Pixel::scale[value][colour] = colour * value / 255;
+      }
+    }
+  };
+} fill_scale;
+
+/* Alpha and depth of runs of layers. The alpha grows as blend_under
+   adds layers to a transparent pixel, and each layer weighs in on the
+   depth by the alpha it adds. */
+unsigned char Pixel::run_alpha[256][129];
+unsigned char Pixel::run_depth[256][129];
+unsigned char Pixel::run_full[256];
+static struct run_tables {
+  run_tables() {
+    for (int value = 0; value < 256; value++) {
+      int alpha = 0;
+      int depth = 0;
+      Pixel::run_alpha[value][0] = Pixel::run_depth[value][0] = 0;
+      for (int count = 1; count < 129; count++) {
+        int added = Pixel::div255(value * (255 - alpha));
+        alpha += added;
+        depth += (count - 1) * added;
+        Pixel::run_alpha[value][count] = alpha;
+        Pixel::run_depth[value][count] =
+          (alpha == 0) ? 0 : (depth + alpha / 2) / alpha;
+      }
+      int full = 1;
+      while (full < 128 && Pixel::run_alpha[value][full + 1] !=
+             Pixel::run_alpha[value][full]) {
+        full++;
+      }
+      Pixel::run_full[value] = full;
+    }
+  };
+} fill_runs;
 
 /* Shade pixel. 0 = no change, +/- 127 = white/black.. */
 void Pixel::shade(signed char value) {
@@ -35,11 +57,14 @@ void Pixel::shade(signed char value) {
   }
 }
 
-/* Light pixel. */
-void Pixel::light(unsigned char value) {
-  R = (R * value) / 255;
-  G = (G * value) / 255;
-  B = (B * value) / 255;
+/* Divide colour by alpha, rounded. Transparent pixels have no colour
+   left to recover. */
+void Pixel::straighten() {
+  if (A == 0 || A == 255)
+    return;
+  R = std::min(255, (R * 255 + A / 2) / A);
+  G = std::min(255, (G * 255 + A / 2) / A);
+  B = std::min(255, (B * 255 + A / 2) / A);
 }
 
 /* Mix in another pixel 50/50.*/
@@ -4,7 +4,10 @@
 #include <ostream>
 
 /*
- * A simple structure for colour data, with blending methods.
+ * A simple structure for colour data, with blending methods. Colours
+ * of blocks are given with straight alpha, but pixels being drawn and
+ * images hold colours premultiplied by their alpha, so that blending
+ * needs no division by it. Images are converted back when written.
  */
 class Pixel {
 public:
@@ -14,7 +17,7 @@ public:
   unsigned char A;
 
   /* Initialise to transparent. */
-  Pixel() : R(0xff), G(0xff), B(0xff), A(0x00) {};
+  Pixel() : R(0x00), G(0x00), B(0x00), A(0x00) {};
   /* Or some other value. */
   Pixel(unsigned char sR, unsigned char sG,
         unsigned char sB, unsigned char sA) : R(sR), G(sG), B(sB), A(sA) {};
@@ -23,22 +26,90 @@ public:
   bool operator==(const Pixel& o) { return R==o.R && G==o.G &&
                                            B==o.B && A==o.A; };
 
-  /* Blend another pixel underneath self. */
+  /* Blend another pixel underneath self. Both are premultiplied. */
   void blend_under(const Pixel& source);
 
-  /* Blend another pixel over self. */
+  /* Blend another pixel over self. Both are premultiplied. */
   void blend_over(const Pixel& source);
 
+  /* Convert straight alpha to premultiplied, and back. */
+  void premultiply();
+  void straighten();
+
+  /* A product of two colour values divided by 255, rounded. Alpha is
+     rounded along with colour, so layers blended over each other can
+     end up a few levels off the alpha straight blending gave, up to 4
+     behind tall stacks of low-alpha blocks. */
+  static unsigned char div255(unsigned int product) {
+    product += 128;
+    return (product + (product >> 8)) >> 8;
+  };
+
   /* Shade pixel. 0 = no change, +/- 127 = white/black.. */
   void shade(signed char value);
 
   /* Light pixel. */
   void light(unsigned char value);
 
+  /* Colour values lit by each light level, so that lighting needs no
+     division: scale[value][colour] = colour * value / 255. */
+  static unsigned char scale[256][256];
+
+  /* A run of count layers of one colour with alpha value, blended
+     under each other, as one layer: run_alpha[value][count] is its
+     alpha, and run_depth[value][count] how many layers down its
+     colour lies on average. Runs are up to 128 layers long. Past
+     run_full[value] layers, more add nothing. */
+  static unsigned char run_alpha[256][129];
+  static unsigned char run_depth[256][129];
+  static unsigned char run_full[256];
+
   /* Mix in another pixel 50/50.*/
   void mix(const Pixel& source);
+
+  /* Blend or mix count source pixels into as many target pixels, the
+     same as pixel by pixel but several pixels at a time where the
+     processor can. See pixel_span.cpp. */
+  static void blend_over_span(Pixel* target, const Pixel* source,
+                              int count);
+  static void mix_span(Pixel* target, const Pixel* source, int count);
 };
 
 std::ostream& operator<<(std::ostream& o, const Pixel& p);
 
+/* Alpha blend another pixel underneath self. It shows through what
+   self leaves uncovered. */
+inline void Pixel::blend_under(const Pixel& source) {
+  unsigned int uncovered = 255 - A;
+  R += div255(source.R * uncovered);
+  G += div255(source.G * uncovered);
+  B += div255(source.B * uncovered);
+  A += div255(source.A * uncovered);
+}
+
+/* Alpha blend another pixel over self. */
+inline void Pixel::blend_over(const Pixel& source) {
+  unsigned int uncovered = 255 - source.A;
+  R = source.R + div255(R * uncovered);
+  G = source.G + div255(G * uncovered);
+  B = source.B + div255(B * uncovered);
+  A = source.A + div255(A * uncovered);
+}
+
+/* Premultiply colour by alpha. */
+inline void Pixel::premultiply() {
+  const unsigned char* covered = scale[A];
+  R = covered[R];
+  G = covered[G];
+  B = covered[B];
+}
+
+/* Light pixel. */
+inline void Pixel::light(unsigned char value) {
+  const unsigned char* lit = scale[value];
+  R = lit[R];
+  G = lit[G];
+  B = lit[B];
+}
+
 #endif
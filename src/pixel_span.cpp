@@ -0,0 +1,185 @@
+#include "pixel.hpp"
+
+/*
+ * Blending of pixel spans. Each operation has a scalar version, which
+ * blends pixel by pixel, and on x86 SSE2 and AVX2 versions that give
+ * the same results several pixels at a time. The fastest version the
+ * processor supports is chosen when first used.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define SPAN_KERNELS
+  #include <immintrin.h>
+#endif
+
+namespace {
+
+/* Blend and mix pixel by pixel. */
+void blend_over_scalar(Pixel* target, const Pixel* source, int count) {
+  for (int i = 0; i < count; i++) {
+    target[i].blend_over(source[i]);
+  }
+}
+void mix_scalar(Pixel* target, const Pixel* source, int count) {
+  for (int i = 0; i < count; i++) {
+    target[i].mix(source[i]);
+  }
+}
+
+#ifdef SPAN_KERNELS
+/*
+ * The kernels follow the scalar arithmetic step by step. Colours are
+ * widened to 16 bit lanes, where a product of two colour values and
+ * the rounding that divides it by 255 both fit. The top colour is
+ * added back as bytes, which can't carry over between channels since
+ * no premultiplied channel exceeds its alpha.
+ */
+
+/* Divide each 16 bit lane by 255, rounded. */
+__attribute__((target("sse2")))
+inline __m128i div255_sse2(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Scale the bottom colours of two widened pixels by what the top ones
+   leave uncovered. */
+__attribute__((target("sse2")))
+inline __m128i uncovered_sse2(__m128i top, __m128i bottom) {
+  __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(top, 0xff), 0xff);
+  return div255_sse2(_mm_mullo_epi16(
+    bottom, _mm_sub_epi16(_mm_set1_epi16(255), alpha)));
+}
+
+/* Blend four pixels of top over four of bottom. */
+__attribute__((target("sse2")))
+inline __m128i over_sse2(__m128i top, __m128i bottom) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = uncovered_sse2(_mm_unpacklo_epi8(top, zero),
+                              _mm_unpacklo_epi8(bottom, zero));
+  __m128i hi = uncovered_sse2(_mm_unpackhi_epi8(top, zero),
+                              _mm_unpackhi_epi8(bottom, zero));
+  return _mm_add_epi8(top, _mm_packus_epi16(lo, hi));
+}
+
+/* Halve each byte, rounding down. */
+__attribute__((target("sse2")))
+inline __m128i half_sse2(__m128i x) {
+  return _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi8(0x7f));
+}
+
+__attribute__((target("sse2")))
+void blend_over_sse2(Pixel* target, const Pixel* source, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i under = _mm_loadu_si128((const __m128i*)(target + i));
+    __m128i over = _mm_loadu_si128((const __m128i*)(source + i));
+    _mm_storeu_si128((__m128i*)(target + i), over_sse2(over, under));
+  }
+  blend_over_scalar(target + i, source + i, count - i);
+}
+
+__attribute__((target("sse2")))
+void mix_sse2(Pixel* target, const Pixel* source, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(target + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(source + i));
+    _mm_storeu_si128((__m128i*)(target + i),
+                     _mm_add_epi8(half_sse2(a), half_sse2(b)));
+  }
+  mix_scalar(target + i, source + i, count - i);
+}
+
+/* The same eight pixels at a time. Unpacking, shuffling and packing
+   work within each 128 bit half, so the halves blend as they do
+   above. */
+__attribute__((target("avx2")))
+inline __m256i div255_avx2(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+inline __m256i uncovered_avx2(__m256i top, __m256i bottom) {
+  __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(top, 0xff),
+                                         0xff);
+  return div255_avx2(_mm256_mullo_epi16(
+    bottom, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)));
+}
+
+__attribute__((target("avx2")))
+inline __m256i over_avx2(__m256i top, __m256i bottom) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i lo = uncovered_avx2(_mm256_unpacklo_epi8(top, zero),
+                              _mm256_unpacklo_epi8(bottom, zero));
+  __m256i hi = uncovered_avx2(_mm256_unpackhi_epi8(top, zero),
+                              _mm256_unpackhi_epi8(bottom, zero));
+  return _mm256_add_epi8(top, _mm256_packus_epi16(lo, hi));
+}
+
+__attribute__((target("avx2")))
+inline __m256i half_avx2(__m256i x) {
+  return _mm256_and_si256(_mm256_srli_epi16(x, 1), _mm256_set1_epi8(0x7f));
+}
+
+__attribute__((target("avx2")))
+void blend_over_avx2(Pixel* target, const Pixel* source, int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i under = _mm256_loadu_si256((const __m256i*)(target + i));
+    __m256i over = _mm256_loadu_si256((const __m256i*)(source + i));
+    _mm256_storeu_si256((__m256i*)(target + i), over_avx2(over, under));
+  }
+  blend_over_sse2(target + i, source + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void mix_avx2(Pixel* target, const Pixel* source, int count) {
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(target + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(source + i));
+    _mm256_storeu_si256((__m256i*)(target + i),
+                        _mm256_add_epi8(half_avx2(a), half_avx2(b)));
+  }
+  mix_sse2(target + i, source + i, count - i);
+}
+#endif
+
+/* The versions used. */
+struct kernels {
+  void (*blend_over)(Pixel*, const Pixel*, int);
+  void (*mix)(Pixel*, const Pixel*, int);
+};
+
+kernels choose() {
+#ifdef SPAN_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels avx2 = {blend_over_avx2, mix_avx2};
+    return avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    kernels sse2 = {blend_over_sse2, mix_sse2};
+    return sse2;
+  }
+#endif
+  kernels scalar = {blend_over_scalar, mix_scalar};
+  return scalar;
+}
+
+const kernels& chosen() {
+  static const kernels result = choose();
+  return result;
+}
+
+}
+
+/* Blend spans of pixels. */
+void Pixel::blend_over_span(Pixel* target, const Pixel* source, int count) {
+  chosen().blend_over(target, source, count);
+}
+void Pixel::mix_span(Pixel* target, const Pixel* source, int count) {
+  chosen().mix(target, source, count);
+}
@@ -2,6 +2,7 @@
 #define H_VECTOR
 
 #include <ostream>
+#include <stdexcept>
 
 /*
  * A tiny 3D vector structure with some simple operators.
@@ -35,4 +36,28 @@ struct pvector {
 
 std::ostream& operator<<(std::ostream& o, const pvector& p);
 
+/* Convert vector to position in an NBT array. */
+inline int pvector::nbt() const {
+  if (x < 0 || x > 16)
+    throw std::out_of_range("X out of bounds for NBT section.");
+  if (z < 0 || z > 16)
+    throw std::out_of_range("Z out of bounds for NBT section.");
+  if (y < 0 || y > 127)
+    throw std::out_of_range("Y out of bounds for NBT section.");
+
+  return y + (z * 128) + (x * 128 * 16);
+}
+
+/* Convert vector to position in an NBT array. Count only 4 bits for
+   each block, and set upper to true if the upper four bits should be
+   used. */
+inline int pvector::nbt(bool& upper) const {
+  int pos = nbt();
+
+  upper = pos & 1;
+  pos /= 2;
+
+  return pos;
+}
+
 #endif
@@ -1,6 +1,9 @@
 #include "image.hpp"
 #include "chunk.hpp"
 #include "render_contour.hpp"
+#include "render_loops.hpp"
+
+#include <algorithm>
 
 /* Simple renderer with no file output. */
 Render_Contour::Render_Contour(const std::string& filename,
@@ -22,12 +25,20 @@ Render_Contour::Render_Contour(const std::string& filename,
         i != 0x38)   // Diamond ore
       colours[i].top.A = colours[i].side.A = 0x00;
   }
+
+  /* Lines lie delta blocks apart, one of them at offset. */
+  int delta = this->options.delta.first;
+  int offset = this->options.offset.first % delta;
+  line_height[0] = false;
+  for (int y = 0; y < 128; y++) {
+    line_height[y + 1] = (y % delta == offset);
+  }
 }
 
-/* The top of blocks divisible by 5 are black. The rest is white. Some
-   blocks are invisible. */
-Pixel Render_Contour::getblock(const chunkbox& chunks, pvector pos,
-                               direction dir) {
+/* The tops of columns on contour lines are black. The rest is white.
+   Some blocks are invisible. */
+inline Pixel Render_Contour::getblock(const chunkbox& chunks, pvector pos,
+                                      direction dir) {
   /* Get a proper target. */
   Chunk* target = fixpvector(chunks, pos);
 
@@ -40,46 +51,129 @@ Pixel Render_Contour::getblock(const chunkbox& chunks, pvector pos,
     return {0, 0, 0, 0};
   }
 
-  /* Tops are black if divisible by 5 (offset for default shoreline). */
-  if ((dir & TOP) && (pos.y % 5 == 3)) {
-    /* But only if there is a neighbouring transparent block. */
-    bool air = false;
-    try {
-      air = air ||
-        (Renderer::getblock(chunks, pos + pvector(1, 0, 0), TOP).A < 0xff);
-    } catch (std::exception& e) {}
-    try {
-      air = air ||
-        (Renderer::getblock(chunks, pos + pvector(0, 1, 0), TOP).A < 0xff);
-    } catch (std::exception& e) {}
-    try {
-      air = air ||
-        (Renderer::getblock(chunks, pos - pvector(1, 0, 0), TOP).A < 0xff);
-    } catch (std::exception& e) {}
-    try {
-      air = air ||
-        (Renderer::getblock(chunks, pos - pvector(0, 1, 0), TOP).A < 0xff);
-    } catch (std::exception& e) {}
-
-    if (air)
-      return {0, 0, 0, 0xff};
+  /* Rays of oblique maps stay within the chunk being drawn. */
+  if ((dir & TOP) && on_line(chunks, pos.x, pos.y, pos.z)) {
+    return {0, 0, 0, 0xff};
   }
 
   return {0xff, 0xff, 0xff, 0xff};
 }
 
 /* Everything is fully lit in contour mode. */
-unsigned char Render_Contour::getlight(const chunkbox& chunks,
-                                       pvector pos,
-                                       direction dir) {
+inline unsigned char Render_Contour::getlight(const chunkbox& chunks,
+                                              pvector pos,
+                                              direction dir) {
   return 255;
 }
 
-/* Finalise and save. */
-void Render_Contour::finalise() {
-  if (image) {
-    /* Make white transparent. */
+/* Render a chunk with loops specialised for contour lines. */
+void Render_Contour::render_chunk(const chunkbox& chunks) {
+  if (!options.oblique.first) {
+    render_surface(chunks);
+  } else {
+    render_oblique<Render_Contour>(chunks);
+  }
+}
+
+/* Make overlay transparent. Top-down maps are drawn transparent. */
+void Render_Contour::finish_image() {
+  /* Make white transparent. */
+  if (options.oblique.first)
     image->colour_replace({0xff, 0xff, 0xff, 0xff}, {0, 0, 0, 0});
+}
+
+/* Find the surface of the chunk. */
+void Render_Contour::measure_surface(const chunkbox& chunks) {
+  if (!chunks.center->blocks())
+    throw std::runtime_error("Chunk has no Blocks section.");
+
+  for (int x = 0; x < 16; x++) {
+    for (int z = 0; z < 16; z++) {
+      surface[x * 16 + z] = column_surface(chunks.center, x, z);
+    }
+  }
+}
+
+/* Height of the highest visible block in a column of a chunk, between
+   the clip heights. */
+int Render_Contour::column_surface(const Chunk* chunk, int x, int z) const {
+  /* Start at the highest block of any kind. */
+  int column = x * 16 + z;
+  const unsigned char* stack = chunk->blocks() + column * 128;
+  int top = std::min<int>(chunk->heights()[column] - 1, options.maxy.first);
+  for (int y = top; y >= options.miny.first; y--) {
+    if (colours[stack[y]].top.A == 0xff)
+      return y;
+  }
+  return -1;
+}
+
+/* Whether the block at x, y, z is invisible. */
+inline bool Render_Contour::open(const chunkbox& chunks,
+                                 int x, int y, int z) const {
+  const Chunk* target = chunks.center;
+  if (z > 15) {
+    target = chunks.west;
+    z -= 16;
+  } else if (z < 0) {
+    target = chunks.east;
+    z += 16;
+  } else if (x > 15) {
+    target = chunks.south;
+    x -= 16;
+  } else if (x < 0) {
+    target = chunks.north;
+    x += 16;
+  }
+  if (!target || !target->blocks())
+    return false;
+
+  return colours[target->blocks()[(x * 16 + z) * 128 + y]].top.A < 0xff;
+}
+
+/* Whether the top of the block at x, y, z is on a contour line. */
+inline bool Render_Contour::on_line(const chunkbox& chunks,
+                                    int x, int y, int z) const {
+  return line_height[y + 1] &&
+    (open(chunks, x + 1, y, z) || open(chunks, x, y, z + 1) ||
+     open(chunks, x - 1, y, z) || open(chunks, x, y, z - 1));
+}
+
+/* Draw a top-down map of the chunk from the surface. Columns are
+   transparent unless they are on a contour line. A pixel of a scaled
+   map is on a line if any column of its cell is, so lines don't break
+   up. */
+void Render_Contour::render_surface(const chunkbox& chunks) {
+  measure_surface(chunks);
+  bool line[16 * 16];
+  for (int x = 0; x < 16; x++) {
+    for (int z = 0; z < 16; z++) {
+      line[x * 16 + z] = on_line(chunks, x, surface[x * 16 + z], z);
+    }
+  }
+
+  const int step = 1 << scale_shift;
+  const pvector& chunk = chunks.center->get_position();
+  int off_x = (bottom_left.z - chunk.z) * 16 + 15;
+  int off_y = (chunk.x - top_right.x) * 16;
+  for (int x = 0; x < 16; x += step) {
+    for (int z = 0; z < 16; z += step) {
+      bool on = false;
+      for (int i = x; i < x + step; i++) {
+        for (int j = z; j < z + step; j++) {
+          on = on || line[i * 16 + j];
+        }
+      }
+
+      Pixel dot;
+      if (on) {
+        dot = {0, 0, 0, 0xff};
+      }
+
+      int img_x = (off_x - z) >> scale_shift;
+      int img_y = (off_y + x) >> scale_shift;
+      place(img_x, img_y);
+      (*image)(img_x, img_y) = dot;
+    }
   }
-  Renderer::finalise();
 }
@@ -14,6 +14,12 @@ public:
   Render_Contour(const std::string& filename, const recipe& options);
 
 protected:
+  /* The render loops sample blocks through the methods below. */
+  friend class Renderer;
+
+  /* Render a chunk with loops specialised for contour lines. */
+  virtual void render_chunk(const chunkbox& chunks);
+
   /* Get colour value of a block. */
   virtual Pixel getblock(const chunkbox& chunks, pvector pos,
                          direction dir);
@@ -23,7 +29,29 @@ protected:
                                  direction dir);
 
   /* Make overlay transparent. */
-  virtual void finalise();
+  virtual void finish_image();
+
+private:
+  /* Whether a height has a contour line, indexed by height + 1. */
+  bool line_height[129];
+
+  /* Height of the highest visible block in each column of the chunk
+     being drawn, indexed as x * 16 + z. No visible block is -1. */
+  int surface[16 * 16];
+  void measure_surface(const chunkbox& chunks);
+  int column_surface(const Chunk* chunk, int x, int z) const;
+
+  /* Whether the block at x, y, z is invisible, where x and z may lie
+     one block into a neighbouring chunk. Blocks in chunks that aren't
+     loaded are not. */
+  bool open(const chunkbox& chunks, int x, int y, int z) const;
+
+  /* Whether the top of the block at x, y, z is on a contour line, where
+     it is at a line height and a block beside it is invisible. */
+  bool on_line(const chunkbox& chunks, int x, int y, int z) const;
+
+  /* Draw a top-down map of the chunk from the surface. */
+  void render_surface(const chunkbox& chunks);
 };
 
 #endif
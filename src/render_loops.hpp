@@ -0,0 +1,563 @@
+#ifndef H_RENDER_LOOPS
+#define H_RENDER_LOOPS
+
+#include "renderer.hpp"
+#include "chunk.hpp"
+#include "image.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+
+/*
+ * Render loops shared by all renderers, and the block sampling they
+ * are built from. Each renderer instantiates the loops with its own
+ * type in render_chunk, so getblock and getlight are called directly
+ * rather than through the vtable, and may be inlined into the loops.
+ */
+
+/* Read a four bit value from an array, or 0 if there is no array. */
+inline unsigned char nibble(const unsigned char* array, int index) {
+  if (!array)
+    return 0;
+
+  unsigned char result = array[index >> 1];
+  return (index & 1) ? result >> 4 : result & 0xf;
+}
+
+/* Test and set the bit of a pixel in a saturation mask. */
+inline bool is_saturated(const unsigned char* mask, int bit) {
+  return mask[bit >> 3] & (1 << (bit & 7));
+}
+inline void saturate(unsigned char* mask, int bit) {
+  mask[bit >> 3] |= 1 << (bit & 7);
+}
+
+/* Get colour value of a block. */
+inline Pixel Renderer::getblock(const chunkbox& chunks, pvector pos,
+                                direction dir) {
+  /* Get a proper target. */
+  Chunk* target = fixpvector(chunks, pos);
+
+  /* Fetch block from target. */
+  unsigned char type = target->blocks(pos);
+  Pixel result = (dir & TOP) ? colours[type].top : colours[type].side;
+
+  if (type == 0x08 || type == 0x09) {
+    /* Block is water. Set alpha based on depth, if data was loaded. */
+    unsigned char invdepth = nibble(target->data(), pos.nbt());
+    if (invdepth > 0) {
+      result.A = 0xff - invdepth * 0x0f;
+    }
+  }
+
+  return result;
+}
+
+/* Get lighting level of a block. */
+inline unsigned char Renderer::getlight(const chunkbox& chunks,
+                                        pvector pos, direction dir) {
+  if (dir == TOP) {
+    pos.y++;
+  } else if (dir == N) {
+    pos.x--;
+  } else if (dir == E) {
+    pos.z--;
+  } else if (dir == S) {
+    pos.x++;
+  } else if (dir == W) {
+    pos.z++;
+  } else if (dir == BOTTOM) {
+    pos.y--;
+  } else {
+    throw std::runtime_error("Cannot get lighting of diagonal block.");
+  }
+
+  /* Sky and block light levels, from 0 to 15. */
+  unsigned char l_sky = 0;
+  unsigned char l_block = 0;
+
+  if (pos.y > options.maxy.first || pos.y < 0) {
+    /* Blocks above the clip height are left out, and there is no
+       lighting data below the map. */
+    l_sky = 15;  // Fully lit by sky.
+    l_block = 0; // Not lit by other sources.
+
+  } else {
+    /* Get a proper target. */
+    Chunk* target = 0;
+    try {
+      target = fixpvector(chunks, pos);
+    } catch (std::range_error& e) {
+      /* Chunk is not loaded. */
+    }
+
+    if (target) {
+      /* Light that wasn't loaded counts as dark. */
+      int index = pos.nbt();
+      l_sky = nibble(target->skylight(), index);
+      l_block = nibble(target->blocklight(), index);
+    }
+  }
+
+  /* Balance lighting. */
+  return lighting[l_sky * 16 + l_block];
+}
+
+/* Negate a cardinal or ordinal direction. */
+inline Renderer::direction Renderer::negate_direction(direction direction) {
+  switch (direction) {
+  case N:  return S;
+  case NE: return SW;
+  case E:  return W;
+  case SE: return NW;
+  case S:  return N;
+  case SW: return NE;
+  case W:  return E;
+  case NW: return SE;
+  case TOP:    return BOTTOM;
+  case BOTTOM: return TOP;
+  default:
+    throw std::logic_error("Cannot negate compound direction.");
+  }
+}
+
+/* Convert a chunkbox-pvector combo to a chunk-pvector combo. The pvector
+   passed in may point outside the center chunk. */
+inline Chunk* Renderer::fixpvector(const chunkbox& chunks, pvector& pos) {
+  Chunk* target = chunks.center;
+
+  /* Make sure height is valid. */
+  if (pos.y < 0 || pos.y > 127) {
+    throw std::logic_error("Trying to read data outside of valid height.");
+  }
+
+  /* Check if block is in a neighbouring chunk. */
+  if (pos.z > 15) {
+    target = chunks.west;
+    pos.z -= 16;
+  } else if (pos.z < 0) {
+    target = chunks.east;
+    pos.z += 16;
+  } else if (pos.x > 15) {
+    target = chunks.south;
+    pos.x -= 16;
+  } else if (pos.x < 0) {
+    target = chunks.north;
+    pos.x += 16;
+  }
+
+  if (pos.x > 15 || pos.x < 0 || pos.z > 15 || pos.z < 0) {
+    /* Target is outside chunkbox. */
+    throw std::range_error("Attempting to read data from unloaded chunk.");
+  }
+  if (!target) {
+    /* Chunk doesn't exist. */
+    throw std::range_error("Attempting to read data from nonexisting chunk.");
+  }
+
+  return target;
+}
+
+/* Get a block, light it and blend behind a pixel. */
+template <class Self>
+inline void Renderer::blendblock(const chunkbox& chunks, pvector pos,
+                                 direction dir, Pixel& top) {
+  Self& self = static_cast<Self&>(*this);
+  Pixel under = self.Self::getblock(chunks, pos, dir);
+  if (under.A > 0) {
+    under.premultiply();
+    unsigned char light = self.Self::getlight(chunks, pos, dir);
+    under.light(light);
+
+    /* Adjust lighting slightly depending on height. */
+    if (options.dimdepth.first) {
+      under.light(pos.y + 128);
+    }
+    if (under.A > 0) {
+      top.blend_under(under);
+    }
+  }
+}
+
+/* Render a flat map of the center chunk one block at a time. */
+template <class Self>
+void Renderer::render_columns(const chunkbox& chunks) {
+  /* Renderers draw nothing for air when its colour is transparent, so
+     columns may start at their highest block. Chunks without blocks
+     are left to getblock to report. */
+  const unsigned char* heights = chunks.center->heights();
+  bool skip_air = (colours[0].top.A == 0) && chunks.center->blocks();
+
+  /* Only the blocks between the clip heights are drawn. */
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  /* Scaled maps sample a column in the middle of each cell. */
+  const int step = 1 << scale_shift;
+  for (int x = step >> 1; x < 16; x += step) {
+    for (int z = step >> 1; z < 16; z += step) {
+      Pixel dot;
+      int top = skip_air ? std::min<int>(heights[x * 16 + z] - 1, clip_top)
+        : clip_top;
+      for (int y = top; y >= clip_bottom; y--) {
+        blendblock<Self>(chunks, {x, z, y}, TOP, dot);
+        if (dot.A == 0xff) {
+          /* Done with this pixel. */
+          break;
+        }
+      }
+
+      /* Paint new dot to map. */
+      int img_x = ((bottom_left.z - chunks.center->get_position().z) * 16
+                   + (15 - z)) >> scale_shift;
+      int img_y = ((chunks.center->get_position().x - top_right.x) * 16
+                   + x) >> scale_shift;
+      place(img_x, img_y);
+      (*image)(img_x, img_y) = dot;
+    }
+  }
+}
+
+/*
+ * Oblique views facing each cardinal direction. A ray cast into the
+ * chunk at column w of the image, depth blocks back from the front,
+ * hits the block at x = x0 + x_w * w + x_depth * depth, and likewise
+ * for z. Side faces facing the viewer are lit from the block in
+ * front, which lies in the front neighbour at depth 0.
+ */
+template <Renderer::direction Dir> struct facing;
+
+template <> struct facing<Renderer::N> {
+  static const Renderer::direction back = Renderer::S;
+  static const int x0 = 15, x_w = 0, x_depth = -1;
+  static const int z0 = 15, z_w = -1, z_depth = 0;
+  static Chunk* front(const Renderer::chunkbox& chunks) {
+    return chunks.south;
+  };
+  static void offset(const pvector& chunk, const pvector& top_right,
+                     const pvector& bottom_left, int top,
+                     int& off_x, int& off_y) {
+    off_x = (bottom_left.z - chunk.z) * 16;
+    off_y = (chunk.x - top_right.x) * 16 + top + 16;
+  };
+};
+
+template <> struct facing<Renderer::E> {
+  static const Renderer::direction back = Renderer::W;
+  static const int x0 = 0, x_w = 1, x_depth = 0;
+  static const int z0 = 15, z_w = 0, z_depth = -1;
+  static Chunk* front(const Renderer::chunkbox& chunks) {
+    return chunks.west;
+  };
+  static void offset(const pvector& chunk, const pvector& top_right,
+                     const pvector&, int top, int& off_x, int& off_y) {
+    off_x = (chunk.x - top_right.x) * 16;
+    off_y = (chunk.z - top_right.z) * 16 + top + 16;
+  };
+};
+
+template <> struct facing<Renderer::S> {
+  static const Renderer::direction back = Renderer::N;
+  static const int x0 = 0, x_w = 0, x_depth = 1;
+  static const int z0 = 0, z_w = 1, z_depth = 0;
+  static Chunk* front(const Renderer::chunkbox& chunks) {
+    return chunks.north;
+  };
+  static void offset(const pvector& chunk, const pvector& top_right,
+                     const pvector& bottom_left, int top,
+                     int& off_x, int& off_y) {
+    off_x = (chunk.z - top_right.z) * 16;
+    off_y = (bottom_left.x - chunk.x) * 16 + top + 16;
+  };
+};
+
+template <> struct facing<Renderer::W> {
+  static const Renderer::direction back = Renderer::E;
+  static const int x0 = 15, x_w = -1, x_depth = 0;
+  static const int z0 = 0, z_w = 0, z_depth = 1;
+  static Chunk* front(const Renderer::chunkbox& chunks) {
+    return chunks.east;
+  };
+  static void offset(const pvector& chunk, const pvector&,
+                     const pvector& bottom_left, int top,
+                     int& off_x, int& off_y) {
+    off_x = (bottom_left.x - chunk.x) * 16;
+    off_y = (bottom_left.z - chunk.z) * 16 + top + 16;
+  };
+};
+
+/*
+ * Oblique views facing each ordinal direction. Rays step diagonally,
+ * fx and fz blocks at a time, and each column of the image follows one
+ * diagonal line of blocks. A block at x, z lies u = ux * x + uz * z
+ * columns across the view, and v = vx * x + vz * z half rows toward
+ * the viewer. Columns alternate between the two side faces turned
+ * toward the viewer.
+ */
+template <int FX, int FZ> struct diagonal_view {
+  static const int fx = FX, fz = FZ;
+  static const int ux = -FZ, uz = FX;
+  static const int vx = -FX, vz = -FZ;
+  static const Renderer::direction face_x = (FX < 0) ? Renderer::S
+                                                     : Renderer::N;
+  static const Renderer::direction face_z = (FZ < 0) ? Renderer::W
+                                                     : Renderer::E;
+};
+
+template <Renderer::direction Dir> struct diagonal;
+template <> struct diagonal<Renderer::NE> : diagonal_view<-1, -1> {};
+template <> struct diagonal<Renderer::SE> : diagonal_view<1, -1> {};
+template <> struct diagonal<Renderer::SW> : diagonal_view<1, 1> {};
+template <> struct diagonal<Renderer::NW> : diagonal_view<-1, 1> {};
+
+/* The diagonal rays through a chunk facing Dir, ordered across the
+   view. Each starts at the column of its front block, x * 16 + z, and
+   passes length blocks. */
+template <Renderer::direction Dir> struct diagonal_rays {
+  int front[31];
+  int length[31];
+
+  diagonal_rays() {
+    typedef diagonal<Dir> view;
+    const int u0 = ((view::ux < 0) ? 15 * view::ux : 0) +
+      ((view::uz < 0) ? 15 * view::uz : 0);
+    int nearest[31];
+    for (int i = 0; i < 31; i++) {
+      length[i] = 0;
+    }
+    for (int x = 0; x < 16; x++) {
+      for (int z = 0; z < 16; z++) {
+        int i = view::ux * x + view::uz * z - u0;
+        int v = view::vx * x + view::vz * z;
+        if (length[i] == 0 || v > nearest[i]) {
+          nearest[i] = v;
+          front[i] = x * 16 + z;
+        }
+        length[i]++;
+      }
+    }
+  };
+
+  /* The rays are the same for every chunk, so they are found once. */
+  static const diagonal_rays& get() {
+    static const diagonal_rays rays;
+    return rays;
+  };
+};
+
+/* Render an oblique map of the center chunk. */
+template <class Self>
+void Renderer::render_oblique(const chunkbox& chunks) {
+  switch (options.dir.first) {
+  case N: render_facing<Self, N>(chunks); break;
+  case E: render_facing<Self, E>(chunks); break;
+  case S: render_facing<Self, S>(chunks); break;
+  case W: render_facing<Self, W>(chunks); break;
+  case NE: render_diagonal<Self, NE>(chunks); break;
+  case SE: render_diagonal<Self, SE>(chunks); break;
+  case SW: render_diagonal<Self, SW>(chunks); break;
+  case NW: render_diagonal<Self, NW>(chunks); break;
+  default:
+    throw std::runtime_error("Invalid render direction.");
+  }
+}
+
+/* Render an oblique map of the center chunk facing Dir. */
+template <class Self, Renderer::direction Dir>
+void Renderer::render_facing(const chunkbox& chunks) {
+  typedef facing<Dir> view;
+
+  /* Rays start at the upper clip height and stop at the lower. */
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  /* Calculate image coordinate offset of chunk. */
+  int off_x, off_y;
+  view::offset(chunks.center->get_position(), top_right, bottom_left,
+               clip_top, off_x, off_y);
+
+  /* Rays pass quickly through the air above each column, unless air
+     is visible. */
+  const unsigned char* heights = chunks.center->heights();
+  bool skip_air = (colours[0].top.A == 0 && colours[0].side.A == 0)
+    && chunks.center->blocks();
+
+  for (int w = 0; w < 16; w++) {
+    for (int y = 16 + clip_top; y >= clip_bottom; y--) {
+      /* Calculate image coordinates. */
+      int img_y = off_y - y;
+      int img_x = off_x + w;
+
+      /* Get initial pixel colour. */
+      Pixel dot;
+      const int bit = img_y * saturated_stride + img_x;
+      if (front_first) {
+        if (is_saturated(saturated.data(), bit)) {
+          /* Pixel is already finished. */
+          continue;
+        }
+        dot = (*image)(img_x, img_y);
+      }
+
+      /* Start of raycast. If y is above the clip height, we are
+         looking at the top of the chunk. */
+      int depth = 0;
+      int ystep = y;
+      bool side = true;
+      if (y > clip_top) {
+        side = false;
+        ystep = clip_top;
+        depth = y - clip_top - 1;
+      }
+      pvector pos(view::x0 + view::x_w * w + view::x_depth * depth,
+                  view::z0 + view::z_w * w + view::z_depth * depth, ystep);
+
+      /* Raycast back and down, in staircase steps. */
+      while (pos.y >= clip_bottom && depth < 16) {
+        /* The side and the top below it are both air while the ray is
+           above the highest block of the column. */
+        if (side && skip_air && pos.y > heights[pos.x * 16 + pos.z]) {
+          pos.y--;
+          pos.x += view::x_depth;
+          pos.z += view::z_depth;
+          depth++;
+          continue;
+        }
+
+        /* Blend the current block onto the pixel. */
+        blendblock<Self>(chunks, pos, side ? view::back : TOP, dot);
+        if (dot.A == 0xff) {
+          /* Done with this pixel. */
+          break;
+        }
+
+        if (side) {
+          /* We just got the side of a block. The pixel behind is
+             the top of the block below. */
+          pos.y--;
+        } else {
+          /* We just got the top of a block. The pixel behind is
+             the side of the block behind. */
+          pos.x += view::x_depth;
+          pos.z += view::z_depth;
+          depth++;
+        }
+        side = !side;
+      }
+
+      /* Paint new dot to map. */
+      if (front_first) {
+        (*image)(img_x, img_y) = dot;
+        if (dot.A == 0xff)
+          saturate(saturated.data(), bit);
+      } else {
+        (*image)(img_x, img_y).blend_over(dot);
+      }
+    }
+  }
+}
+
+/* Render an oblique map of the center chunk facing the ordinal
+   direction Dir. Each ray is followed only while it is inside the
+   chunk, and the chunks before and after it finish the pixel. */
+template <class Self, Renderer::direction Dir>
+void Renderer::render_diagonal(const chunkbox& chunks) {
+  typedef diagonal<Dir> view;
+  const diagonal_rays<Dir>& rays = diagonal_rays<Dir>::get();
+  const pvector& chunk = chunks.center->get_position();
+
+  /* Rays pass quickly through the air above each column, unless air
+     is visible. */
+  const unsigned char* heights = chunks.center->heights();
+  bool skip_air = (colours[0].top.A == 0 && colours[0].side.A == 0)
+    && chunks.center->blocks();
+
+  /* Rays start at the upper clip height and stop at the lower. */
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  for (int i = 0; i < 31; i++) {
+    /* Calculate image coordinates of the front block. */
+    const int front_x = rays.front[i] >> 4;
+    const int front_z = rays.front[i] & 0xf;
+    int u = view::ux * (chunk.x * 16 + front_x) +
+      view::uz * (chunk.z * 16 + front_z);
+    int v = view::vx * (chunk.x * 16 + front_x) +
+      view::vz * (chunk.z * 16 + front_z);
+    const int img_x = u - view_u_min;
+    const int off_y = (v - view_v_min) / 2 + clip_top + 1;
+    const direction face = (u & 1) ? view::face_x : view::face_z;
+
+    for (int y = rays.length[i] + clip_top; y >= clip_bottom; y--) {
+      int img_y = off_y - y;
+
+      /* Get initial pixel colour. */
+      Pixel dot;
+      const int bit = img_y * saturated_stride + img_x;
+      if (front_first) {
+        if (is_saturated(saturated.data(), bit)) {
+          /* Pixel is already finished. */
+          continue;
+        }
+        dot = (*image)(img_x, img_y);
+      }
+
+      /* Start of raycast. If y is above the clip height, we are
+         looking at the top of the chunk. */
+      int depth = 0;
+      int ystep = y;
+      bool side = true;
+      if (y > clip_top) {
+        side = false;
+        ystep = clip_top;
+        depth = y - clip_top - 1;
+      }
+      pvector pos(front_x + view::fx * depth, front_z + view::fz * depth,
+                  ystep);
+
+      /* Raycast back and down, in staircase steps. */
+      while (pos.y >= clip_bottom && depth < rays.length[i]) {
+        /* The side and the top below it are both air while the ray is
+           above the highest block of the column. */
+        if (side && skip_air && pos.y > heights[pos.x * 16 + pos.z]) {
+          pos.y--;
+          pos.x += view::fx;
+          pos.z += view::fz;
+          depth++;
+          continue;
+        }
+
+        /* Blend the current block onto the pixel. */
+        blendblock<Self>(chunks, pos, side ? face : TOP, dot);
+        if (dot.A == 0xff) {
+          /* Done with this pixel. */
+          break;
+        }
+
+        if (side) {
+          /* We just got the side of a block. The pixel behind is
+             the top of the block below. */
+          pos.y--;
+        } else {
+          /* We just got the top of a block. The pixel behind is
+             the side of the block behind. */
+          pos.x += view::fx;
+          pos.z += view::fz;
+          depth++;
+        }
+        side = !side;
+      }
+
+      /* Paint new dot to map. */
+      if (front_first) {
+        (*image)(img_x, img_y) = dot;
+        if (dot.A == 0xff)
+          saturate(saturated.data(), bit);
+      } else {
+        (*image)(img_x, img_y).blend_over(dot);
+      }
+    }
+  }
+}
+
+#endif
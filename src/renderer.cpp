@@ -5,17 +5,23 @@
 #include "intstring.hpp"
 
 #include "render_contour.hpp"
+#include "render_loops.hpp"
 
 #include <stdexcept>
 #include <png.h>
 #include <list>
 #include <set>
+#include <typeinfo>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <sstream>
 
 /* Generate a list of renderers based on an option string. It is the
    callers responsibility to delete these renderers. If source is
    given, only one renderer will be created and no filename is parsed.
-   All members of opts may be overridden except rotation and
-   obliqueness. */
+   All members of opts may be overridden except rotation, obliqueness,
+   region, scale and clip heights. */
 Renderer::RenderList Renderer::make_renderers(const std::string& options,
                                               const recipe* source) {
   RenderList result;
@@ -25,11 +31,25 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
   std::list<ucharopt> lightlevels;
   std::list<boolopt> dimdepths;
   std::list<boolopt> angles;
+  std::list<regionopt> areas;
 
   /* Type of renderer and list of requested overlays. */
   overlay_type type = DEFAULT;
   std::list<std::string> overlays;
 
+  /* Blocks along each side of a pixel. */
+  std::list<ucharopt> scales;
+
+  /* Heights of the highest and lowest blocks drawn. */
+  ucharopt maxy(127, "maxy=127");
+  ucharopt miny(0, "miny=0");
+  bool clipped = false;
+
+  /* Height between contour lines, and the height of one of them. */
+  ucharopt delta(5, "delta=5");
+  ucharopt offset(3, "offset=3");
+  bool contour_options = false;
+
   /* Separate filename and options. */
   size_t filestop = 0;
   std::string filename;
@@ -125,6 +145,54 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
           throw std::logic_error(string("Invalid light level specified: ")
                                  + opt);
         }
+      } else if (opt.substr(0, 6) == "scale=") {
+        try {
+          int scale = stringtoint(opt.substr(6));
+          if (scale != 1 && scale != 2 && scale != 4 && scale != 8 &&
+              scale != 16) {
+            throw std::logic_error(string("Scale must be 1, 2, 4, 8 or 16: ")
+                                   + opt);
+          }
+          scales.push_back(ucharopt(scale, opt));
+        } catch (std::runtime_error& e) {
+          throw std::logic_error(string("Invalid scale specified: ") + opt);
+        }
+      } else if (opt.substr(0, 5) == "maxy=" ||
+                 opt.substr(0, 5) == "miny=") {
+        bool is_max = (opt[1] == 'a');
+        try {
+          int value = stringtoint(opt.substr(5));
+          if (value < 0 || value > 127) {
+            throw std::logic_error(string("Clip height out of range: ")
+                                   + opt);
+          }
+          (is_max ? maxy : miny) = ucharopt(value, opt);
+          clipped = true;
+        } catch (std::runtime_error& e) {
+          throw std::logic_error(string("Invalid clip height specified: ")
+                                 + opt);
+        }
+      } else if (opt.substr(0, 6) == "delta=" ||
+                 opt.substr(0, 7) == "offset=") {
+        bool is_delta = (opt[0] == 'd');
+        try {
+          int value = stringtoint(opt.substr(is_delta ? 6 : 7));
+          if (value < (is_delta ? 1 : 0) || value > 127) {
+            throw std::logic_error(string("Contour height out of range: ")
+                                   + opt);
+          }
+          (is_delta ? delta : offset) = ucharopt(value, opt);
+          contour_options = true;
+        } catch (std::runtime_error& e) {
+          throw std::logic_error(string("Invalid contour height specified: ")
+                                 + opt);
+        }
+      } else if (opt.substr(0, 7) == "chunks=") {
+        regionopt area;
+        area.second = opt;
+        Level::chunk_bounds(opt.substr(7), area.first.top_right,
+                            area.first.bottom_left);
+        areas.push_back(area);
       } else {
         throw std::logic_error(string("Invalid renderer option: ") + opt);
       }
@@ -133,6 +201,18 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
     optstart = optstop + 1;
   } while (optstop != std::string::npos);
 
+  /* The clip heights must leave some blocks to draw. */
+  if (miny.first > maxy.first) {
+    throw std::logic_error(string("Clip heights leave nothing to draw: ")
+                           + maxy.second + "," + miny.second);
+  }
+
+  /* Only contour maps have lines to adjust. */
+  if (contour_options && type != CONTOUR) {
+    throw std::logic_error("Contour heights can only be given for contour "
+                           "maps.");
+  }
+
   /* Merge options into opts, if given. */
   if (source) {
     /* No rotations or obliqueness may be given. */
@@ -142,8 +222,22 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
     if (!angles.empty()) {
       throw std::logic_error("You cannot specify angles for overlays.");
     }
+    if (!areas.empty()) {
+      throw std::logic_error("You cannot specify chunks for overlays.");
+    }
+    if (!scales.empty()) {
+      throw std::logic_error("You cannot specify scale for overlays.");
+    }
+    if (clipped) {
+      throw std::logic_error("You cannot specify clip heights for "
+                             "overlays.");
+    }
     rotations.push_back(source->dir);
     angles.push_back(source->oblique);
+    areas.push_back(source->area);
+    scales.push_back(source->scale);
+    maxy = source->maxy;
+    miny = source->miny;
 
     /* No multiples allowed. */
     if (lightlevels.size() > 1 || dimdepths.size() > 1) {
@@ -167,6 +261,18 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
       dimdepths.push_back(boolopt(true, "dimdepth"));   // Dim deep areas.
     if (angles.empty())
       angles.push_back(boolopt(false, "topdown"));      // Top down map.
+    if (areas.empty())
+      areas.push_back(regionopt(region(), ""));         // Whole map.
+    if (scales.empty())
+      scales.push_back(ucharopt(1, "scale=1"));         // Full size.
+
+    /* A map covers one rectangle of chunks, at one scale. */
+    if (areas.size() > 1) {
+      throw std::logic_error("Only one chunk rectangle may be given.");
+    }
+    if (scales.size() > 1) {
+      throw std::logic_error("Only one scale may be given.");
+    }
 
     /* If any lists have more than 1 entries, we need
        wildcards in the filename. */
@@ -217,8 +323,15 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
             continue;
           }
 
+          /* Only top-down maps can be scaled. */
+          if (angle->first && scales.front().first > 1) {
+            throw std::logic_error("Oblique maps cannot be scaled.");
+          }
+
           /* Make recipe struct. */
-          const recipe target = {*rotation, *lightlevel, *dimdepth, *angle};
+          const recipe target = {*rotation, *lightlevel, *dimdepth, *angle,
+                                 areas.front(), scales.front(), maxy, miny,
+                                 delta, offset};
 
           /* Create renderer depending on type. */
           Renderer* add;
@@ -252,11 +365,35 @@ Renderer::RenderList Renderer::make_renderers(const std::string& options,
 
 /* Construct renderer. */
 Renderer::Renderer(const std::string& filename, const recipe& options)
-  : options(options), filename(filename), image(0), finalised(false) {
+  : options(options), filename(filename), image(0), saturated_stride(0),
+    twinned(false), raster_owner(0), raster_users(0), seconds(0),
+    chunk_quality(FULL), drawn_turns(0), finalised(false), prepared(false) {
+  /* Cardinal top-down maps are drawn in their final orientation. */
+  if (!options.oblique.first && (options.dir.first & CARDINAL))
+    drawn_turns = turns(options.dir.first);
+
+  /* Scales are powers of two. */
+  scale_shift = 0;
+  while ((1 << scale_shift) < options.scale.first)
+    scale_shift++;
+
+  /* Chunks are passed in reverse map order unless told otherwise. */
+  int x, z;
+  front_side(x, z);
+  front_first = (x >= 0 && z >= 0);
+
   /* Make a local copy of the default colours. */
   for (int i = 0; i < 256; i++) {
     colours[i] = default_colours[i];
   }
+
+  /* Balance sky and block light once, rather than for every block. */
+  for (int i = 0; i < 256; i++) {
+    int l_sky = (i >> 4) * 17;
+    int l_block = (i & 0xf) * 17;
+    lighting[i] = ((l_sky * options.lightlevel.first) / 255) +
+      ((l_block * (255 - options.lightlevel.first)) / 255);
+  }
 }
 
 /* Release memory. */
@@ -282,399 +419,1040 @@ void Renderer::set_surface(const Level::position& top_right_chunk,
   if (image)
     throw std::runtime_error("Attempted to allocate image memory twice.");
 
-  if (!options.oblique.first) {
-    /* Allocate memory for a flat unrotated map. We may rotate
-       it when rendering is finished. */
-    image = new Image({size.z, size.x});
+  if (raster_owner) {
+    /* The map is rotated from the image of another renderer. */
+  } else if (!options.oblique.first) {
+    /* Allocate memory for a flat map, facing the way it is drawn. */
+    north_width = size.z >> scale_shift;
+    north_height = size.x >> scale_shift;
+    if (drawn_turns == 2 || drawn_turns == 6) {
+      image = new Image({north_height, north_width});
+    } else {
+      image = new Image({north_width, north_height});
+    }
   } else {
-    /* Calculate size of oblique map. */
+    /* Calculate size of oblique map. It is as tall as the blocks
+       between the clip heights. */
+    const int band = options.maxy.first - options.miny.first + 1;
     if (options.dir.first & CARDINAL) {
       if (options.dir.first & (N | S)) {
         /* North or south facing map. */
-        image = new Image({size.z, size.x + 128});
+        image = new Image({size.z, size.x + band});
       } else {
         /* East or west facing map. */
-        image = new Image({size.x, size.z + 128});
+        image = new Image({size.x, size.z + band});
       }
     } else if (options.dir.first & ORDINAL) {
-      /* TODO: Calculate size of ordinal oblique map. */
-      throw std::logic_error("This alpha release cannot render "
-                             "ordinal oblique maps yet.");
+      /* Diagonal map. Find the view coordinates of the corners. */
+      int fx = (options.dir.first & (NE | NW)) ? -1 : 1;
+      int fz = (options.dir.first & (NE | SE)) ? -1 : 1;
+      pvector low = top_right * 16;
+      pvector high = bottom_left * 16 + pvector(15, 15);
+      int u_max = std::max(-fz * low.x, -fz * high.x) +
+        std::max(fx * low.z, fx * high.z);
+      int v_max = std::max(-fx * low.x, -fx * high.x) +
+        std::max(-fz * low.z, -fz * high.z);
+      view_u_min = std::min(-fz * low.x, -fz * high.x) +
+        std::min(fx * low.z, fx * high.z);
+      view_v_min = std::min(-fx * low.x, -fx * high.x) +
+        std::min(-fz * low.z, -fz * high.z);
+
+      /* A column for each diagonal, and a row for every two steps
+         toward the viewer. */
+      image = new Image({u_max - view_u_min + 1,
+                         (v_max - view_v_min) / 2 + band + 1});
     } else {
       /* Oblique TOP or BOTTOM is not possible. */
       throw std::runtime_error("Invalid oblique direction for allocation.");
     }
+
+    /* No pixel is finished yet. */
+    saturated_stride = image->dimensions().x;
+    saturated.assign((saturated_stride * image->dimensions().y + 7) / 8, 0);
+  }
+
+  /* Allocate for all overlays too. Overlays blended a chunk at a time
+     only need a tile, drawn facing the way the map is. */
+  const int cells = 16 >> scale_shift;
+  for (RenderList::iterator overlay = overlays.begin();
+       overlay != overlays.end(); ++overlay) {
+    if (blends_overlays()) {
+      (*overlay)->drawn_turns = drawn_turns;
+      (*overlay)->north_width = (*overlay)->north_height = cells;
+      (*overlay)->image = new Image({cells, cells});
+    } else {
+      (*overlay)->set_surface(top_right_chunk, bottom_left_chunk);
+    }
+  }
+}
+
+/* Whether overlays are blended into the map a chunk at a time. Pixels
+   of top-down maps are finished once their chunk is drawn, while
+   oblique pixels wait for the chunks behind them. Other renderer
+   types may still adjust their image once drawn, which must not touch
+   the overlays. */
+bool Renderer::blends_overlays() const {
+  return !options.oblique.first && typeid(*this) == typeid(Renderer);
+}
+
+/* Draw the overlays of a chunk into their tiles, and blend them onto
+   the chunk in this map. */
+void Renderer::blend_overlays(const chunkbox& chunks) {
+  if (overlays.empty() || !blends_overlays())
+    return;
+
+  const pvector& chunk = chunks.center->get_position();
+  const int cells = 16 >> scale_shift;
+  int off_x = (bottom_left.z - chunk.z) * cells;
+  int off_y = (chunk.x - top_right.x) * cells;
+  int corner_x = off_x;
+  int corner_y = off_y;
+  int far_x = off_x + cells - 1;
+  int far_y = off_y + cells - 1;
+  place(corner_x, corner_y);
+  place(far_x, far_y);
+  corner_x = std::min(corner_x, far_x);
+  corner_y = std::min(corner_y, far_y);
+  for (RenderList::iterator it = overlays.begin(); it != overlays.end();
+       ++it) {
+    /* The tile covers the chunk alone. */
+    Renderer& overlay = **it;
+    overlay.top_right = overlay.bottom_left = chunk;
+    overlay.render_chunk(chunks);
+    overlay.finish_image();
+
+    /* The tile is turned like the map, so its rows are blended into
+       rows of the map from the corner of the chunk nearest the
+       origin. */
+    for (int y = 0; y < cells; y++) {
+      Pixel::blend_over_span(&(*image)(corner_x, corner_y + y),
+                             &(*overlay.image)(0, y), cells);
+    }
+  }
+}
+
+/* Let this renderer draw the image of another one in its own
+   raycasts, if they differ only in light level and depth dimming. */
+bool Renderer::twin(Renderer* other) {
+  /* Other renderer types sample blocks in their own way. */
+  if (typeid(*this) != typeid(Renderer) || typeid(*other) != typeid(Renderer))
+    return false;
+
+  /* Twins can't have twins of their own, and maps rotated from
+     another image aren't drawn at all. */
+  if (other == this || twinned || other->twinned || !other->twins.empty() ||
+      raster_owner || other->raster_owner)
+    return false;
+
+  /* The rays must be the same. */
+  if (options.dir.first != other->options.dir.first ||
+      options.oblique.first != other->options.oblique.first ||
+      options.area.second != other->options.area.second ||
+      options.scale.first != other->options.scale.first ||
+      options.maxy.first != other->options.maxy.first ||
+      options.miny.first != other->options.miny.first ||
+      std::memcmp(colours, other->colours, sizeof(colours)) != 0)
+    return false;
+
+  twins.push_back(other);
+  other->twinned = true;
+  return true;
+}
+
+/* Let another renderer rotate its map from the unrotated image of
+   this one, if they differ only in direction. */
+bool Renderer::share_raster(Renderer* other) {
+  /* Both must be top-down maps of the same type. */
+  if (typeid(*this) != typeid(*other) || options.oblique.first ||
+      other->options.oblique.first)
+    return false;
+
+  /* Images can be shared once, and not passed along. */
+  if (other == this || raster_owner || other->raster_owner ||
+      other->raster_users > 0 || twinned || other->twinned ||
+      !twins.empty() || !other->twins.empty())
+    return false;
+
+  /* Ordinal maps filter as they rotate, so they must start from a map
+     facing north to look the same. */
+  if ((turns(other->options.dir.first) & 1) && drawn_turns != 0)
+    return false;
+
+  /* The images must be the same, apart from rotation. */
+  if (options.lightlevel.first != other->options.lightlevel.first ||
+      options.dimdepth.first != other->options.dimdepth.first ||
+      options.area.second != other->options.area.second ||
+      options.scale.first != other->options.scale.first ||
+      options.maxy.first != other->options.maxy.first ||
+      options.miny.first != other->options.miny.first ||
+      options.delta.first != other->options.delta.first ||
+      options.offset.first != other->options.offset.first ||
+      std::memcmp(colours, other->colours, sizeof(colours)) != 0)
+    return false;
+
+  /* Overlays blended into the image come along with it. */
+  if (blends_overlays()) {
+    if (overlays.size() != other->overlays.size())
+      return false;
+    RenderList::iterator mine = overlays.begin();
+    RenderList::iterator theirs = other->overlays.begin();
+    for (; mine != overlays.end(); ++mine, ++theirs) {
+      if (typeid(**mine) != typeid(**theirs) ||
+          (*mine)->options.lightlevel.first !=
+          (*theirs)->options.lightlevel.first ||
+          (*mine)->options.dimdepth.first !=
+          (*theirs)->options.dimdepth.first ||
+          (*mine)->options.delta.first != (*theirs)->options.delta.first ||
+          (*mine)->options.offset.first != (*theirs)->options.offset.first ||
+          std::memcmp((*mine)->colours, (*theirs)->colours,
+                      sizeof(colours)) != 0)
+        return false;
+    }
   }
 
-  /* Allocate for all overlays too. */
+  other->raster_owner = this;
+  raster_users++;
+  return true;
+}
+
+/* Pair up renderers that can share images or raycasts. Shared images
+   are paired first, since they save the most. */
+int Renderer::fuse(RenderList& renderers) {
+  int fused = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (RenderList::iterator primary = renderers.begin();
+         primary != renderers.end(); ++primary) {
+      if ((*primary)->twinned || (*primary)->raster_owner)
+        continue;
+
+      RenderList::iterator other = primary;
+      for (++other; other != renderers.end(); ++other) {
+        if (pass == 0 ? (*primary)->share_raster(*other)
+                      : (*primary)->twin(*other))
+          fused++;
+      }
+    }
+  }
+
+  return fused;
+}
+
+/* List the images drawn by the array render loops: this one first,
+   then those of the twins. */
+void Renderer::gather_outputs(std::vector<output>& result) {
+  output own = {image, lighting, options.dimdepth.first, saturated.data()};
+  result.push_back(own);
+  for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+       ++twin) {
+    output add = {(*twin)->image, (*twin)->lighting,
+                  (*twin)->options.dimdepth.first,
+                  (*twin)->saturated.data()};
+    result.push_back(add);
+  }
+}
+
+/* Which sides of an oblique map the viewer looks from. */
+void Renderer::front_side(int& x, int& z) const {
+  x = z = 0;
+  if (!options.oblique.first)
+    return;
+
+  direction dir = options.dir.first;
+  if (dir & (N | NE | NW))
+    x = 1;
+  else if (dir & (S | SE | SW))
+    x = -1;
+  if (dir & (E | NE | SE))
+    z = 1;
+  else if (dir & (W | NW | SW))
+    z = -1;
+}
+
+/* Tell an oblique map which way through the map chunks are passed. */
+void Renderer::set_front_to_back(bool front_first) {
+  this->front_first = front_first;
+
+  for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+       ++twin) {
+    (*twin)->set_front_to_back(front_first);
+  }
   for (RenderList::iterator overlay = overlays.begin();
        overlay != overlays.end(); ++overlay) {
-    (*overlay)->set_surface(top_right_chunk, bottom_left_chunk);
+    (*overlay)->set_front_to_back(front_first);
+  }
+}
+
+/* Set the quality chunks are drawn in, here and in the twins. A
+   twin's own setting is ignored, since another thread may be drawing
+   it along with the renderer it is twinned with. */
+void Renderer::set_quality(quality level) {
+  if (twinned)
+    return;
+
+  chunk_quality = level;
+  for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+       ++twin) {
+    (*twin)->chunk_quality = level;
   }
 }
 
 /* Pass a chunk to the renderer and let it do its thing. */
 void Renderer::render(const chunkbox& chunks) {
+  /* Twinned images were drawn along with another renderer, and
+     shared images are rotated from another renderer's. */
+  if (!twinned && !raster_owner) {
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    render_chunk(chunks);
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    seconds += elapsed.count();
+
+    /* The chunk is drawn, in the twins too. Put overlays on top. */
+    blend_overlays(chunks);
+    for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+         ++twin) {
+      (*twin)->blend_overlays(chunks);
+    }
+  }
+
+  /* Render overlays that draw images of their own. */
+  if (!blends_overlays()) {
+    for (RenderList::iterator overlay = overlays.begin();
+         overlay != overlays.end(); ++overlay) {
+      (*overlay)->render(chunks);
+    }
+  }
+}
+
+/* Render a chunk with the loops specialised for plain renderers. */
+void Renderer::render_chunk(const chunkbox& chunks) {
+  if (!chunks.center->blocks()) {
+    /* Render block by block, which also reports missing blocks. Twins
+       draw their own images. */
+    if (!options.oblique.first) {
+      render_columns<Renderer>(chunks);
+    } else {
+      render_oblique<Renderer>(chunks);
+    }
+    for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+         ++twin) {
+      (*twin)->render_chunk(chunks);
+    }
+  } else {
+    /* Note chunks drawn in less than full quality. Oblique maps
+       always draw every ray. */
+    quality drawn = chunk_quality;
+    if (options.oblique.first && drawn > OPAQUE)
+      drawn = OPAQUE;
+    if (drawn != FULL) {
+      const pvector& chunk = chunks.center->get_position();
+      std::pair<Level::position, quality> note(Level::position(chunk.x,
+                                                               chunk.z),
+                                               drawn);
+      degraded.push_back(note);
+      for (RenderList::iterator twin = twins.begin(); twin != twins.end();
+           ++twin) {
+        (*twin)->degraded.push_back(note);
+      }
+    }
+
+    /* Draw this image and those of the twins in the same raycasts, a
+       few at a time so that their pixels stay in registers. */
+    std::vector<output> outputs;
+    gather_outputs(outputs);
+    for (size_t first = 0; first < outputs.size(); first += 4) {
+      const output* group = &outputs[first];
+      switch (std::min<size_t>(outputs.size() - first, 4)) {
+      case 1: render_arrays<1>(chunks, group); break;
+      case 2: render_arrays<2>(chunks, group); break;
+      case 3: render_arrays<3>(chunks, group); break;
+      case 4: render_arrays<4>(chunks, group); break;
+      }
+    }
+  }
+}
+
+/* Render a chunk to Count outputs at once, working on the chunk
+   arrays directly. */
+template <int Count>
+void Renderer::render_arrays(const chunkbox& chunks, const output* outputs) {
   if (!options.oblique.first) {
     /* Flat map. Render it unrotated. We may rotate it when
        all chunks are rendered. */
-    for (int x = 0; x < 16; x++) {
-      for (int z = 0; z < 16; z++) {
-        Pixel dot;
-        for (int y = 127; y >= 0; y--) {
-          blendblock(chunks, {x, z, y}, TOP, dot);
-          if (dot.A == 0xff) {
-            /* Done with this pixel. */
-            break;
+    render_flat<Count>(chunks, outputs);
+  } else {
+    switch (options.dir.first) {
+    case N: render_facing_arrays<N, Count>(chunks, outputs); break;
+    case E: render_facing_arrays<E, Count>(chunks, outputs); break;
+    case S: render_facing_arrays<S, Count>(chunks, outputs); break;
+    case W: render_facing_arrays<W, Count>(chunks, outputs); break;
+    case NE: render_diagonal_arrays<NE, Count>(chunks, outputs); break;
+    case SE: render_diagonal_arrays<SE, Count>(chunks, outputs); break;
+    case SW: render_diagonal_arrays<SW, Count>(chunks, outputs); break;
+    case NW: render_diagonal_arrays<NW, Count>(chunks, outputs); break;
+    }
+  }
+}
+
+/* Blend a run of count layers of a block colour, the top one at height
+   y and all lit by light, under the pixels of each output. */
+template <int Count>
+inline void Renderer::blend_run(Pixel* dots, const output* outputs,
+                                Pixel colour, int count, int light, int y) {
+  const int dim = y - Pixel::run_depth[colour.A][count] + 128;
+  colour.A = Pixel::run_alpha[colour.A][count];
+  colour.premultiply();
+  for (int i = 0; i < Count; i++) {
+    Pixel lit = colour;
+    lit.light(outputs[i].lighting[light]);
+    if (outputs[i].dimdepth) {
+      lit.light(dim);
+    }
+    dots[i].blend_under(lit);
+  }
+}
+
+/* Render a flat map of the center chunk, reading the chunk arrays
+   directly. The air above the ground is skipped, using the column
+   heights found when the chunk was read, and runs of a translucent
+   block are blended in one step. The result is that of
+   render_columns, for each output, but for rounding within runs. */
+template <int Count>
+void Renderer::render_flat(const chunkbox& chunks, const output* outputs) {
+  const Chunk& chunk = *chunks.center;
+  const unsigned char* blocks = chunk.blocks();
+  const unsigned char* skylight = chunk.skylight();
+  const unsigned char* blocklight = chunk.blocklight();
+  const unsigned char* data = chunk.data();
+
+  /* Start each column at its highest block, unless air is visible,
+     and draw only the blocks between the clip heights. */
+  const unsigned char* heights = chunk.heights();
+  const bool air = (colours[0].top.A > 0);
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  /* Lighting only changes colours, so every output gets the same
+     alpha and the rays stop at the same blocks. */
+  Pixel dots[Count];
+
+  /* Scaled maps sample a column in the middle of each cell. Coarse
+     chunks sample one for every two by two cells. */
+  const int step = 1 << scale_shift;
+  const int cover = (chunk_quality >= COARSE && step < 16) ? 2 : 1;
+  const bool lit = (chunk_quality < UNLIT);
+  const bool see_through = (chunk_quality < OPAQUE);
+  int off_x = (bottom_left.z - chunk.get_position().z) * 16 + 15;
+  int off_y = (chunk.get_position().x - top_right.x) * 16;
+  for (int x = step >> 1; x < 16; x += step * cover) {
+    for (int z = step >> 1; z < 16; z += step * cover) {
+      const int column = x * 16 + z;
+      for (int i = 0; i < Count; i++) {
+        dots[i] = Pixel();
+      }
+      const int top = air ? clip_top
+        : std::min<int>(heights[column] - 1, clip_top);
+
+      /* Blocks are blended a run at a time, a run being the same
+         block with the same alpha, lit alike, one under another. It
+         is blended as one layer once the next block differs. Past the
+         layers that make a run as opaque as it gets, or once the
+         pixel is too opaque for even one layer to show, the rest of
+         a run adds nothing and is passed. */
+      Pixel run_colour;
+      unsigned char run_type = 0;
+      int run = 0;
+      int run_full = 0;
+      int run_light = 0;
+      int run_top = 0;
+      for (int y = top; y >= clip_bottom; y--) {
+        const int index = column * 128 + y;
+        unsigned char type = blocks[index];
+        Pixel under = colours[type].top;
+
+        /* Water gets alpha based on depth. */
+        if ((type == 0x08 || type == 0x09) && data && see_through) {
+          unsigned char invdepth = nibble(data, index);
+          if (invdepth > 0) {
+            under.A = 0xff - invdepth * 0x0f;
           }
         }
+        if (under.A == 0)
+          continue;
+        if (!see_through)
+          under.A = 0xff;
+
+        const bool same = run > 0 && type == run_type &&
+          under.A == run_colour.A;
+        if (same && run >= run_full)
+          continue;
+
+        /* Light the block by the space above it. Above the clip
+           height, blocks are fully lit by the sky. */
+        int light = 0xf0;
+        if (y < clip_top && lit) {
+          light = nibble(skylight, index + 1) * 16 +
+            nibble(blocklight, index + 1);
+        }
+        if (same && light == run_light) {
+          run++;
+          continue;
+        }
+
+        /* Blend the run that ends here. Opaque blocks finish the
+           pixel at once. */
+        if (run > 0) {
+          blend_run<Count>(dots, outputs, run_colour, run, run_light,
+                           run_top);
+          run = 0;
+        }
+        if (under.A == 0xff) {
+          blend_run<Count>(dots, outputs, under, 1, light, y);
+        }
+        if (dots[0].A == 0xff) {
+          /* Done with this pixel. */
+          break;
+        }
 
-        /* Paint new dot to map. */
-        int img_x = (bottom_left.z - chunks.center->get_position().z) * 16
-          + (15 - z);
-        int img_y = (chunks.center->get_position().x - top_right.x) * 16 + x;
-        (*image)(img_x, img_y) = dot;
+        run_colour = under;
+        run_type = type;
+        run_light = light;
+        run_top = y;
+        run = 1;
+        run_full = (Pixel::div255(under.A * (255 - dots[0].A)) > 0) ?
+          Pixel::run_full[under.A] : 1;
       }
-    }
-  } else {
-    /* Oblique map. */
-    if (options.dir.first & CARDINAL) {
-      /* Facing a cardinal direction. */
-      bool front_to_back = options.dir.first & (N | E);
-
-      /* Calculate image coordinate offset of chunk. */
-      int off_x, off_y;
-      switch (options.dir.first) {
-      case N:
-        /* Facing north. */
-        off_x = (bottom_left.z - chunks.center->get_position().z) * 16;
-        off_y = (chunks.center->get_position().x - top_right.x) * 16
-          + 127 + 16;
-        break;
-
-      case E:
-        /* Facing east. */
-        off_x = (chunks.center->get_position().x - top_right.x) * 16;
-        off_y = (chunks.center->get_position().z - top_right.z) * 16
-          + 127 + 16;
-        break;
-
-      case S:
-        /* Facing south. */
-        off_x = (chunks.center->get_position().z - top_right.z) * 16;
-        off_y = (bottom_left.x - chunks.center->get_position().x) * 16
-          + 127 + 16;
-        break;
-
-      case W:
-        /* Facing west. */
-        off_x = (bottom_left.x - chunks.center->get_position().x) * 16;
-        off_y = (bottom_left.z - chunks.center->get_position().z) * 16
-          + 127 + 16;
-        break;
+      if (run > 0) {
+        blend_run<Count>(dots, outputs, run_colour, run, run_light, run_top);
       }
 
-      for (int w = 0; w < 16; w++) {
-        for (int y = 16 + 127; y >= 0; y--) {
-          /* Calculate image coordinates. */
-          int img_y = off_y - y;
-          int img_x = off_x + w;
-
-          /* Get initial pixel colour. */
-          Pixel dot;
-          if (front_to_back) {
-            dot = (*image)(img_x, img_y);
-            if (dot.A == 0xff) {
-              /* Pixel is already finished. */
-              continue;
-            }
+      /* Paint new dots to maps. */
+      for (int cell_x = 0; cell_x < cover; cell_x++) {
+        for (int cell_z = 0; cell_z < cover; cell_z++) {
+          int img_x = (off_x - z - cell_z * step) >> scale_shift;
+          int img_y = (off_y + x + cell_x * step) >> scale_shift;
+          place(img_x, img_y);
+          for (int i = 0; i < Count; i++) {
+            (*outputs[i].image)(img_x, img_y) = dots[i];
           }
+        }
+      }
+    }
+  }
+}
 
-          /* Start of raycast. */
-          int depth = 0;
-          int ystep = y;
-          direction step = negate_direction(options.dir.first);
+/* Render an oblique map of the center chunk facing Dir, reading the
+   chunk arrays directly. Rays step through the arrays by fixed
+   strides. The result is the same as that of render_facing, for each
+   output. */
+template <Renderer::direction Dir, int Count>
+void Renderer::render_facing_arrays(const chunkbox& chunks,
+                                    const output* outputs) {
+  typedef facing<Dir> view;
+  const Chunk& chunk = *chunks.center;
+  const unsigned char* blocks = chunk.blocks();
+  const unsigned char* skylight = chunk.skylight();
+  const unsigned char* blocklight = chunk.blocklight();
+  const unsigned char* data = chunk.data();
+
+  /* Side faces at the front are lit from the chunk in front. Missing
+     light is dark. */
+  const Chunk* front = view::front(chunks);
+  const unsigned char* front_skylight = front ? front->skylight() : 0;
+  const unsigned char* front_blocklight = front ? front->blocklight() : 0;
+
+  /* Rays pass quickly through the air above each column, unless air
+     is visible. */
+  const unsigned char* heights = chunk.heights();
+  const bool air = (colours[0].top.A > 0 || colours[0].side.A > 0);
+
+  /* Rays start at the upper clip height and stop at the lower. */
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  /* Lower quality chunks skip lighting, or transparency too. */
+  const bool lit = (chunk_quality < UNLIT);
+  const bool see_through = (chunk_quality < OPAQUE);
+
+  /* Array index steps. Heights lie next to each other. */
+  const int along = view::x_w * 16 * 128 + view::z_w * 128;
+  const int behind = view::x_depth * 16 * 128 + view::z_depth * 128;
+  const int origin = view::x0 * 16 * 128 + view::z0 * 128;
+
+  /* Lighting only changes colours, so every output gets the same
+     alpha and the rays stop at the same blocks. */
+  Pixel dots[Count];
+
+  /* Calculate image coordinate offset of chunk. */
+  int off_x, off_y;
+  view::offset(chunk.get_position(), top_right, bottom_left, clip_top,
+               off_x, off_y);
+
+  for (int w = 0; w < 16; w++) {
+    for (int y = 16 + clip_top; y >= clip_bottom; y--) {
+      /* Calculate image coordinates. */
+      int img_y = off_y - y;
+      int img_x = off_x + w;
+
+      /* Get initial pixel colours. */
+      const int bit = img_y * saturated_stride + img_x;
+      if (front_first) {
+        if (is_saturated(outputs[0].saturated, bit)) {
+          /* Pixel is already finished. */
+          continue;
+        }
+        for (int i = 0; i < Count; i++) {
+          dots[i] = (*outputs[i].image)(img_x, img_y);
+        }
+      } else {
+        for (int i = 0; i < Count; i++) {
+          dots[i] = Pixel();
+        }
+      }
 
-          /* If y is more than 127, we are looking at the top of the chunk. */
-          if (y > 127) {
-            step = TOP;
-            ystep = 127;
-            depth = y - 128;
+      /* Start of raycast. If y is above the clip height, we are
+         looking at the top of the chunk. */
+      int depth = 0;
+      int ystep = y;
+      bool side = true;
+      if (y > clip_top) {
+        side = false;
+        ystep = clip_top;
+        depth = y - clip_top - 1;
+      }
+      int index = origin + along * w + behind * depth + ystep;
+
+      /* Raycast back and down, in staircase steps. */
+      while (ystep >= clip_bottom && depth < 16) {
+        /* The side and the top below it are both air while the ray is
+           above the highest block of the column, index >> 7. */
+        if (side && !air && ystep > heights[index >> 7]) {
+          ystep--;
+          depth++;
+          index += behind - 1;
+          continue;
+        }
+
+        unsigned char type = blocks[index];
+        Pixel under = side ? colours[type].side : colours[type].top;
+
+        /* Water gets alpha based on depth. */
+        if ((type == 0x08 || type == 0x09) && data && see_through) {
+          unsigned char invdepth = nibble(data, index);
+          if (invdepth > 0) {
+            under.A = 0xff - invdepth * 0x0f;
           }
+        }
 
-          /* Raycast back and down. */
-          while (ystep >= 0 && depth < 16) {
-            /* Convert depth and height to position inside chunk. */
-            pvector pos(0, 0, ystep);
-            switch (options.dir.first) {
-            case N:
-              /* Facing north. */
-              pos.x = 15 - depth;
-              pos.z = 15 - w;
-              break;
-
-            case E:
-              /* Facing east. */
-              pos.x = w;
-              pos.z = 15 - depth;
-              break;
-
-            case S:
-              /* Facing south. */
-              pos.x = depth;
-              pos.z = w;
-              break;
-
-            case W:
-              /* Facing west. */
-              pos.x = 15 - w;
-              pos.z = depth;
-              break;
+        if (under.A > 0) {
+          if (!see_through)
+            under.A = 0xff;
+
+          /* Light tops by the space above them, and sides by the
+             space in front of them. Above the clip height, blocks are
+             fully lit by the sky. */
+          int light;
+          if (!lit) {
+            light = 0xf0;
+          } else if (!side) {
+            light = (ystep < clip_top) ?
+              nibble(skylight, index + 1) * 16 +
+              nibble(blocklight, index + 1) : 0xf0;
+          } else if (depth > 0) {
+            light = nibble(skylight, index - behind) * 16 +
+              nibble(blocklight, index - behind);
+          } else {
+            light = nibble(front_skylight, index + 15 * behind) * 16 +
+              nibble(front_blocklight, index + 15 * behind);
+          }
+          under.premultiply();
+          for (int i = 0; i < Count; i++) {
+            Pixel lit = under;
+            lit.light(outputs[i].lighting[light]);
+            if (outputs[i].dimdepth) {
+              lit.light(ystep + 128);
             }
+            dots[i].blend_under(lit);
+          }
+          if (dots[0].A == 0xff) {
+            /* Done with this pixel. */
+            break;
+          }
+        }
 
-            /* Blend the current block onto the pixel. */
-            blendblock(chunks, pos, step, dot);
-            if (dot.A == 0xff) {
-              /* Done with this pixel. */
-              break;
-            }
+        if (side) {
+          /* We just got the side of a block. The pixel behind is
+             the top of the block below. */
+          ystep--;
+          index--;
+        } else {
+          /* We just got the top of a block. The pixel behind is
+             the side of the block behind. */
+          depth++;
+          index += behind;
+        }
+        side = !side;
+      }
 
-            /* Step to the block behind this one (in staircase steps). */
-            if (step & CARDINAL) {
-              /* We just got the side of a block. The pixel behind is
-                 the top of the block below. */
-              step = TOP;
-              ystep--;
-            } else {
-              /* We just got the top of a block. The pixel behind is
-                 the side of the block behind. */
-              step = negate_direction(options.dir.first);
-              depth++;
-            }
+      /* Paint new dots to maps. */
+      for (int i = 0; i < Count; i++) {
+        if (front_first) {
+          (*outputs[i].image)(img_x, img_y) = dots[i];
+          if (dots[i].A == 0xff)
+            saturate(outputs[i].saturated, bit);
+        } else {
+          (*outputs[i].image)(img_x, img_y).blend_over(dots[i]);
+        }
+      }
+    }
+  }
+}
+
+/* Render an oblique map of the center chunk facing the ordinal
+   direction Dir, reading the chunk arrays directly. Rays step through
+   the arrays by fixed strides. The result is the same as that of
+   render_diagonal, for each output. */
+template <Renderer::direction Dir, int Count>
+void Renderer::render_diagonal_arrays(const chunkbox& chunks,
+                                      const output* outputs) {
+  typedef diagonal<Dir> view;
+  const diagonal_rays<Dir>& rays = diagonal_rays<Dir>::get();
+  const Chunk& chunk = *chunks.center;
+  const unsigned char* blocks = chunk.blocks();
+  const unsigned char* skylight = chunk.skylight();
+  const unsigned char* blocklight = chunk.blocklight();
+  const unsigned char* data = chunk.data();
+
+  /* Side faces at the front edges are lit from the chunks beside.
+     Missing light is dark. */
+  const Chunk* beside_x = (view::vx > 0) ? chunks.south : chunks.north;
+  const Chunk* beside_z = (view::vz > 0) ? chunks.west : chunks.east;
+  const unsigned char* beside_x_skylight = beside_x ? beside_x->skylight() : 0;
+  const unsigned char* beside_x_blocklight =
+    beside_x ? beside_x->blocklight() : 0;
+  const unsigned char* beside_z_skylight = beside_z ? beside_z->skylight() : 0;
+  const unsigned char* beside_z_blocklight =
+    beside_z ? beside_z->blocklight() : 0;
+
+  /* Rays pass quickly through the air above each column, unless air
+     is visible. */
+  const unsigned char* heights = chunk.heights();
+  const bool air = (colours[0].top.A > 0 || colours[0].side.A > 0);
+
+  /* Rays start at the upper clip height and stop at the lower. */
+  const int clip_top = options.maxy.first;
+  const int clip_bottom = options.miny.first;
+
+  /* Lower quality chunks skip lighting, or transparency too. */
+  const bool lit = (chunk_quality < UNLIT);
+  const bool see_through = (chunk_quality < OPAQUE);
+
+  /* Array index steps. Heights lie next to each other. */
+  const int behind = view::fx * 16 * 128 + view::fz * 128;
+  const int toward_x = view::vx * 16 * 128;
+  const int toward_z = view::vz * 128;
+
+  /* Lighting only changes colours, so every output gets the same
+     alpha and the rays stop at the same blocks. */
+  Pixel dots[Count];
+
+  const pvector& position = chunk.get_position();
+  for (int i = 0; i < 31; i++) {
+    /* Calculate image coordinates of the front block. */
+    const int front_x = rays.front[i] >> 4;
+    const int front_z = rays.front[i] & 0xf;
+    int u = view::ux * (position.x * 16 + front_x) +
+      view::uz * (position.z * 16 + front_z);
+    int v = view::vx * (position.x * 16 + front_x) +
+      view::vz * (position.z * 16 + front_z);
+    const int img_x = u - view_u_min;
+    const int off_y = (v - view_v_min) / 2 + clip_top + 1;
+
+    /* Side faces of the column are lit from the block toward the
+       viewer along x or z. Only the front block may have it in the
+       chunk beside. */
+    const bool face_x = (u & 1);
+    const int toward = face_x ? toward_x : toward_z;
+    const int edge = face_x ? front_x : front_z;
+    const int step = face_x ? view::vx : view::vz;
+    const bool front_beside = (edge + step < 0 || edge + step > 15);
+    const unsigned char* front_skylight = skylight;
+    const unsigned char* front_blocklight = blocklight;
+    int front_toward = toward;
+    if (front_beside) {
+      front_skylight = face_x ? beside_x_skylight : beside_z_skylight;
+      front_blocklight = face_x ? beside_x_blocklight : beside_z_blocklight;
+      front_toward = toward - step * 16 * (face_x ? 16 * 128 : 128);
+    }
+
+    for (int y = rays.length[i] + clip_top; y >= clip_bottom; y--) {
+      int img_y = off_y - y;
+
+      /* Get initial pixel colours. */
+      const int bit = img_y * saturated_stride + img_x;
+      if (front_first) {
+        if (is_saturated(outputs[0].saturated, bit)) {
+          /* Pixel is already finished. */
+          continue;
+        }
+        for (int j = 0; j < Count; j++) {
+          dots[j] = (*outputs[j].image)(img_x, img_y);
+        }
+      } else {
+        for (int j = 0; j < Count; j++) {
+          dots[j] = Pixel();
+        }
+      }
+
+      /* Start of raycast. If y is above the clip height, we are
+         looking at the top of the chunk. */
+      int depth = 0;
+      int ystep = y;
+      bool side = true;
+      if (y > clip_top) {
+        side = false;
+        ystep = clip_top;
+        depth = y - clip_top - 1;
+      }
+      int index = rays.front[i] * 128 + behind * depth + ystep;
+
+      /* Raycast back and down, in staircase steps. */
+      while (ystep >= clip_bottom && depth < rays.length[i]) {
+        /* The side and the top below it are both air while the ray is
+           above the highest block of the column, index >> 7. */
+        if (side && !air && ystep > heights[index >> 7]) {
+          ystep--;
+          depth++;
+          index += behind - 1;
+          continue;
+        }
+
+        unsigned char type = blocks[index];
+        Pixel under = side ? colours[type].side : colours[type].top;
+
+        /* Water gets alpha based on depth. */
+        if ((type == 0x08 || type == 0x09) && data && see_through) {
+          unsigned char invdepth = nibble(data, index);
+          if (invdepth > 0) {
+            under.A = 0xff - invdepth * 0x0f;
           }
+        }
 
-          /* Paint new dot to map. */
-          if (front_to_back) {
-            (*image)(img_x, img_y) = dot;
+        if (under.A > 0) {
+          if (!see_through)
+            under.A = 0xff;
+
+          /* Light tops by the space above them, and sides by the
+             space in front of them. Above the clip height, blocks are
+             fully lit by the sky. */
+          int light;
+          if (!lit) {
+            light = 0xf0;
+          } else if (!side) {
+            light = (ystep < clip_top) ?
+              nibble(skylight, index + 1) * 16 +
+              nibble(blocklight, index + 1) : 0xf0;
+          } else if (depth > 0) {
+            light = nibble(skylight, index + toward) * 16 +
+              nibble(blocklight, index + toward);
           } else {
-            (*image)(img_x, img_y).blend_over(dot);
+            light = nibble(front_skylight, index + front_toward) * 16 +
+              nibble(front_blocklight, index + front_toward);
           }
+          under.premultiply();
+          for (int j = 0; j < Count; j++) {
+            Pixel lit = under;
+            lit.light(outputs[j].lighting[light]);
+            if (outputs[j].dimdepth) {
+              lit.light(ystep + 128);
+            }
+            dots[j].blend_under(lit);
+          }
+          if (dots[0].A == 0xff) {
+            /* Done with this pixel. */
+            break;
+          }
+        }
+
+        if (side) {
+          /* We just got the side of a block. The pixel behind is
+             the top of the block below. */
+          ystep--;
+          index--;
+        } else {
+          /* We just got the top of a block. The pixel behind is
+             the side of the block behind. */
+          depth++;
+          index += behind;
         }
+        side = !side;
       }
 
-    } else if (options.dir.first & ORDINAL) {
-      /* TODO: Render oblique images. */
-    } else {
-      throw std::runtime_error("Invalid render direction.");
+      /* Paint new dots to maps. */
+      for (int j = 0; j < Count; j++) {
+        if (front_first) {
+          (*outputs[j].image)(img_x, img_y) = dots[j];
+          if (dots[j].A == 0xff)
+            saturate(outputs[j].saturated, bit);
+        } else {
+          (*outputs[j].image)(img_x, img_y).blend_over(dots[j]);
+        }
+      }
     }
   }
-
-  /* Render all overlays too. */
-  for (RenderList::iterator overlay = overlays.begin();
-       overlay != overlays.end(); ++overlay) {
-    (*overlay)->render(chunks);
-  }
 }
 
 /* Make any last minute adjustments. */
 void Renderer::finalise() {
-  if (!image) {
+  /* Rotating and blending overlays must only happen once. */
+  if (finalised)
+    return;
+
+  if (!image && !raster_owner) {
     throw std::logic_error("Finalising failed: No image.");
   }
+  prepare_image();
 
   if (!options.oblique.first) {
-    /* Top-down images must be rotated. */
-    int angle;
-    switch (options.dir.first) {
-    case N: angle = 0; break;
-    case NE: angle = 7; break;
-    case E: angle = 6; break;
-    case SE: angle = 5; break;
-    case S: angle = 4; break;
-    case SW: angle = 3; break;
-    case W: angle = 2; break;
-    case NW: angle = 1; break;
-    default:
-      throw std::logic_error("Invalid rotation of image.");
+    /* Top-down images may still need rotating. */
+    int angle = turns(options.dir.first);
+
+    if (raster_owner) {
+      /* Rotate the shared image. */
+      if (raster_owner->finalised) {
+        throw std::logic_error("Finalising failed: Shared image was "
+                               "already rotated.");
+      }
+      raster_owner->prepare_image();
+      image = new Image(*raster_owner->image,
+                        (angle - raster_owner->drawn_turns + 8) % 8);
+      degraded = raster_owner->degraded;
+    } else if (angle != drawn_turns) {
+      Image* rotate = new Image(*image, (angle - drawn_turns + 8) % 8);
+      delete image;
+      image = rotate;
     }
-    Image* rotate = new Image(*image, angle);
-    delete image;
-    image = rotate;
   }
 
-  /* Blend overlays. */
-  for (RenderList::iterator it = overlays.begin();
-       it != overlays.end(); ++it) {
-    (*it)->finalise();
+  /* Blend overlays that draw images of their own. */
+  if (!blends_overlays()) {
+    for (RenderList::iterator it = overlays.begin();
+         it != overlays.end(); ++it) {
+      (*it)->finalise();
 
-    image->overlay((*it)->get_image());
+      image->overlay((*it)->get_image());
+    }
   }
 
   finalised = true;
 }
 
-/* Finalise and save image. */
-void Renderer::save() {
-  finalise();
-
-  /* Trim on ordinal rotations and all oblique angles. */
-  bool trim = options.oblique.first || (options.dir.first & ORDINAL);
-
-  image->output(filename, trim);
-}
-
-/* Get colour value of a block. */
-Pixel Renderer::getblock(const chunkbox& chunks, pvector pos,
-                         direction dir) {
-  /* Get a proper target. */
-  Chunk* target = fixpvector(chunks, pos);
-
-  /* Fetch block from target. */
-  unsigned char type = target->blocks(pos);
-  Pixel result = (dir & TOP) ? colours[type].top : colours[type].side;
-
-  if (type == 0x08 || type == 0x09) {
-    test = true;
-    /* Block is water. Set alpha based on depth. */
-    try {
-      unsigned char invdepth = target->data(pos);
-      if (invdepth > 0) {
-        result.A = 0xff - invdepth * 0x0f;
-      }
-    } catch (std::runtime_error& e) { /* Data was not loaded. */ }
-  } else {
-    test = false;
+/* Eighths of a clockwise turn a map facing north is rotated by to face
+   a direction. */
+int Renderer::turns(direction dir) {
+  switch (dir) {
+  case N: return 0;
+  case NE: return 7;
+  case E: return 6;
+  case SE: return 5;
+  case S: return 4;
+  case SW: return 3;
+  case W: return 2;
+  case NW: return 1;
+  default:
+    throw std::logic_error("Invalid rotation of image.");
   }
-
-  return result;
 }
 
-/* Get lighting level of a block. */
-unsigned char Renderer::getlight(const chunkbox& chunks, pvector pos,
-                                 direction dir) {
-  if (dir == TOP) {
-    pos.y++;
-  } else if (dir == N) {
-    pos.x--;
-  } else if (dir == E) {
-    pos.z--;
-  } else if (dir == S) {
-    pos.x++;
-  } else if (dir == W) {
-    pos.z++;
-  } else if (dir == BOTTOM) {
-    pos.y--;
-  } else {
-    throw std::runtime_error("Cannot get lighting of diagonal block.");
+/* Find where a pixel of the map facing north is drawn. */
+void Renderer::place(int& x, int& y) const {
+  int north_x = x;
+  switch (drawn_turns) {
+  case 2:
+    x = north_height - 1 - y;
+    y = north_x;
+    break;
+  case 4:
+    x = north_width - 1 - x;
+    y = north_height - 1 - y;
+    break;
+  case 6:
+    x = y;
+    y = north_width - 1 - north_x;
+    break;
   }
+}
 
-  unsigned char l_sky = 0;
-  unsigned char l_block = 0;
+/* Adjust the unrotated image, once. Maps sharing the image have no
+   image of their own to adjust. */
+void Renderer::prepare_image() {
+  if (prepared)
+    return;
 
-  if (pos.y > 127 || pos.y < 0) {
-    /* There is no lighting data above or below the map. */
-    l_sky = 255; // Fully lit by sky.
-    l_block = 0; // Not lit by other sources.
+  if (image)
+    finish_image();
+  prepared = true;
+}
 
-  } else {
-    /* Get a proper target. */
-    Chunk* target = 0;
-    try {
-      target = fixpvector(chunks, pos);
-    } catch (std::range_error& e) {
-      /* Chunk is not loaded. */
-    }
+/* Finalise a list of renderers in parallel. Shared images are
+   adjusted first, then the maps sharing them are rotated, and then
+   the rest are finalised. */
+void Renderer::finalise_all(RenderList& renderers) {
+  std::vector<Renderer*> passes[3];
+  for (RenderList::iterator renderer = renderers.begin();
+       renderer != renderers.end(); ++renderer) {
+    if ((*renderer)->raster_users > 0)
+      passes[0].push_back(*renderer);
+    passes[(*renderer)->raster_owner ? 1 : 2].push_back(*renderer);
+  }
 
-    if (target) {
-      try {
-        l_sky = target->skylight(pos) * 17;
-      } catch (std::runtime_error& e) {
-        /* Skylight data not loaded. */
-      }
+  std::string failure;
+  for (int pass = 0; pass < 3; pass++) {
+    const std::vector<Renderer*>& batch = passes[pass];
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)batch.size(); i++) {
       try {
-        l_block = target->blocklight(pos) * 17;
-      } catch (std::runtime_error& e) {
-        /* Blocklight data not loaded. */
+        if (pass == 0) {
+          batch[i]->prepare_image();
+        } else {
+          batch[i]->finalise();
+        }
+      } catch (std::exception& e) {
+#pragma omp critical(finalise)
+        failure = e.what();
       }
     }
   }
 
-  /* Balance lighting. */
-  return ((l_sky * options.lightlevel.first) / 255) +
-    ((l_block * (255 - options.lightlevel.first)) / 255);
-}
-
-/* Get a block, light it and blend behind a pixel. */
-void Renderer::blendblock(const chunkbox& chunks, pvector pos,
-                          direction dir, Pixel& top) {
-  Pixel under = getblock(chunks, pos, dir);
-  if (under.A > 0) {
-    unsigned char light = getlight(chunks, pos, dir);
-    under.light(light);
-
-    /* Adjust lighting slightly depending on height. */
-    if (options.dimdepth.first) {
-      under.light(pos.y + 128);
-    }
-    if (under.A > 0) {
-      top.blend_under(under);
-    }
-  }
-}
-
-/* Negate a cardinal or ordinal direction. */
-Renderer::direction Renderer::negate_direction(direction direction) {
-  switch (direction) {
-  case N:  return S;
-  case NE: return SW;
-  case E:  return W;
-  case SE: return NW;
-  case S:  return N;
-  case SW: return NE;
-  case W:  return E;
-  case NW: return SE;
-  case TOP:    return BOTTOM;
-  case BOTTOM: return TOP;
-  default:
-    throw std::logic_error("Cannot negate compound direction.");
-  }
+  if (!failure.empty())
+    throw std::runtime_error(failure);
 }
 
-/* Convert a chunkbox-pvector combo to a chunk-pvector combo. The pvector
-   passed in may point outside the center chunk. */
-Chunk* Renderer::fixpvector(const chunkbox& chunks, pvector& pos) {
-  Chunk* target = chunks.center;
-
-  /* Make sure height is valid. */
-  if (pos.y < 0 || pos.y > 127) {
-    throw std::logic_error("Trying to read data outside of valid height.");
-  }
+/* Finalise and save image. */
+void Renderer::save() {
+  finalise();
 
-  /* Check if block is in a neighbouring chunk. */
-  if (pos.z > 15) {
-    target = chunks.west;
-    pos.z -= 16;
-  } else if (pos.z < 0) {
-    target = chunks.east;
-    pos.z += 16;
-  } else if (pos.x > 15) {
-    target = chunks.south;
-    pos.x -= 16;
-  } else if (pos.x < 0) {
-    target = chunks.north;
-    pos.x += 16;
-  }
+  /* Trim on ordinal rotations and all oblique angles. */
+  bool trim = options.oblique.first || (options.dir.first & ORDINAL);
 
-  if (pos.x > 15 || pos.x < 0 || pos.z > 15 || pos.z < 0) {
-    /* Target is outside chunkbox. */
-    throw std::range_error("Attempting to read data from unloaded chunk.");
-  }
-  if (!target) {
-    /* Chunk doesn't exist. */
-    throw std::range_error("Attempting to read data from nonexisting chunk.");
+  /* List the chunks drawn in less than full quality, as dimensions
+     for --chunks, so that a later run can draw them again. */
+  std::list<Image::text> texts;
+  if (!degraded.empty()) {
+    static const char* names[QUALITIES] = {"full", "unlit", "opaque",
+                                           "coarse"};
+    std::ostringstream chunks;
+    for (std::list<std::pair<Level::position, quality> >::const_iterator
+           it = degraded.begin(); it != degraded.end(); ++it) {
+      chunks << names[it->second] << " 1x1" << std::showpos
+             << it->first.second << it->first.first << std::noshowpos
+             << "\n";
+    }
+    texts.push_back(Image::text("Degraded chunks", chunks.str()));
   }
 
-  return target;
+  image->output(filename, trim, texts);
 }
 
 /* Return a reference to the image. Can only be done after it has been
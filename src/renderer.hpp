@@ -16,7 +16,6 @@ class Image;
  * This class does the default rendering and outputs to filesystem.
  */
 class Renderer {
-  bool test;
 public:
   struct chunkbox {
     Chunk* center; // Chunk being rendered.
@@ -43,6 +42,19 @@ public:
     ALL = CARDINAL + ORDINAL + TOP + BOTTOM
   };
 
+  /* Corners plain renderers may cut to keep up with a deadline, from
+     the least noticeable on. Each quality cuts the corners of those
+     before it too: blocks are lit as if by the sky, then hide what
+     lies behind them, and then top-down maps draw a column for every
+     two by two cells and copy it to the rest. */
+  enum quality {
+    FULL,
+    UNLIT,
+    OPAQUE,
+    COARSE,
+    QUALITIES
+  };
+
   /* Possible overlays. */
   enum overlay_type {
     DEFAULT,
@@ -54,19 +66,37 @@ public:
   typedef std::pair<unsigned char, std::string> ucharopt;
   typedef std::pair<bool, std::string> boolopt;
 
+  /* Rectangle of chunks to render, by its corners. An empty string
+     means the whole map. */
+  struct region {
+    Level::position top_right;
+    Level::position bottom_left;
+    bool contains(const Level::position& pos) const {
+      return pos.first >= top_right.first && pos.first <= bottom_left.first &&
+        pos.second >= top_right.second && pos.second <= bottom_left.second;
+    };
+  };
+  typedef std::pair<region, std::string> regionopt;
+
   /* Holds the needed info to create a renderer. */
   struct recipe {
     directionopt dir;
     ucharopt lightlevel;
     boolopt dimdepth;
     boolopt oblique;
+    regionopt area;
+    ucharopt scale;
+    ucharopt maxy;
+    ucharopt miny;
+    ucharopt delta;
+    ucharopt offset;
   };
 
   /* Generate a list of renderers based on an option string. It is the
      callers responsibility to delete these renderers. If source is
      given, only one renderer will be created and no filename is
-     parsed.  All members of opts may be overridden except rotation
-     and obliqueness. */
+     parsed.  All members of opts may be overridden except rotation,
+     obliqueness, region, scale and clip heights. */
   typedef std::list<Renderer*> RenderList;
   static RenderList make_renderers(const std::string& options,
                                    const recipe* source = 0);
@@ -81,15 +111,64 @@ public:
   void set_surface(const Level::position& top_right_chunk,
                    const Level::position& bottom_left_chunk);
 
+  /* Let this renderer draw the image of another one in its own
+     raycasts. Only plain renderers that differ in nothing but light
+     level and depth dimming can share raycasts. Returns true if other
+     was taken on. */
+  bool twin(Renderer* other);
+
+  /* Let another renderer rotate its map from the unrotated image of
+     this one. Only top-down renderers of the same type that differ in
+     nothing but direction can share an image. Returns true if other
+     will. */
+  bool share_raster(Renderer* other);
+
+  /* Pair up renderers that can share images or raycasts. Returns the
+     number of renderers whose images are drawn by others. */
+  static int fuse(RenderList& renderers);
+
+  /* Which sides of an oblique map the viewer looks from: 1 toward
+     higher coordinates, -1 toward lower and 0 along neither, for x
+     and z. Both are 0 for top-down maps. */
+  void front_side(int& x, int& z) const;
+
+  /* Tell an oblique map whether each chunk will be passed after the
+     chunks in front of it, or before them. Drawing front to back lets
+     rays toward finished pixels be skipped. The default suits chunks
+     passed in reverse map order. */
+  void set_front_to_back(bool front_first);
+
+  /* Set the quality chunks are drawn in from now on. Chunks drawn in
+     less than full quality are listed in the saved image. Twins are
+     drawn in the quality of the renderer they are twinned with. */
+  void set_quality(quality level);
+
   /* Pass a chunk to the renderer and let it do its thing. */
   void render(const chunkbox& chunks);
 
   /* Make any last minute adjustments. */
-  virtual void finalise();
+  void finalise();
+
+  /* Finalise a list of renderers in parallel. Maps sharing the image
+     of another renderer are rotated before it is, but after it has
+     been adjusted. */
+  static void finalise_all(RenderList& renderers);
+
+  /* Seconds of rendering saved by sharing the image of another
+     renderer. */
+  double saved_seconds() const {
+    return raster_owner ? raster_owner->seconds : 0;
+  };
 
   /* Save image. */
   void save();
 
+  /* Get the options used to create the renderer. */
+  const recipe& get_recipe() const { return options; };
+
+  /* Get the file the image will be written to. */
+  const std::string& get_filename() const { return filename; };
+
   /* Return a reference to the image. Can only be done after it has been
      finalised. The reference is valid until the renderer is deleted. */
   const Image& get_image() const;
@@ -118,6 +197,10 @@ protected:
   static colourmap default_colours[256];
   colourmap colours[256];
 
+  /* Light level of a block lit by sky and block light levels from 0
+     to 15, indexed as sky * 16 + block. */
+  unsigned char lighting[256];
+
   /* World position of corner chunks. */
   pvector top_right;
   pvector bottom_left;
@@ -125,12 +208,116 @@ protected:
   /* Rendered image. */
   Image* image;
 
-  /* Overlays. */
+  /* View coordinates of the first column and row of an ordinal
+     oblique map. See diagonal_view in render_loops.hpp. */
+  int view_u_min;
+  int view_v_min;
+
+  /* Whether oblique maps are drawn front to back, and which of their
+     pixels are already opaque, a bit each, row by row. */
+  bool front_first;
+  std::vector<unsigned char> saturated;
+  int saturated_stride;
+
+  /* Overlays. Those of plain top-down maps are drawn a chunk at a
+     time into a tile, and blended into the map as soon as the chunk
+     is drawn. Other overlays draw full images, blended in when the
+     map is finalised. */
   RenderList overlays;
+  bool blends_overlays() const;
+  void blend_overlays(const chunkbox& chunks);
+
+  /* Renderers whose images are drawn along with this one, and whether
+     another renderer draws the image of this one. */
+  RenderList twins;
+  bool twinned;
+
+  /* Renderer whose unrotated image this one is rotated from, or 0,
+     and the number of renderers rotated from this one. */
+  Renderer* raster_owner;
+  int raster_users;
+
+  /* Seconds spent rendering chunks, overlays not included. */
+  double seconds;
+
+  /* Quality chunks are drawn in, and the chunks that were drawn in
+     less than full quality. */
+  quality chunk_quality;
+  std::list<std::pair<Level::position, quality> > degraded;
+
+  /* Eighths of a clockwise turn top-down maps are drawn rotated by, as
+     for Image. Cardinal maps are drawn facing their final direction.
+     Ordinal maps are drawn facing north and rotated when finalised,
+     which also filters them. */
+  int drawn_turns;
+  static int turns(direction dir);
+
+  /* Top-down maps may draw a pixel for each square cell of 1 <<
+     scale_shift blocks, from the column nearest its middle. */
+  int scale_shift;
+
+  /* Size of a top-down map facing north, and where a pixel of it is
+     drawn. */
+  int north_width;
+  int north_height;
+  void place(int& x, int& y) const;
+
+  /* An image drawn by the array render loops, with its own lighting
+     and saturation mask. */
+  struct output {
+    Image* image;
+    const unsigned char* lighting;
+    bool dimdepth;
+    unsigned char* saturated;
+  };
+  void gather_outputs(std::vector<output>& result);
 
   /* Is the renderer finalised? */
   bool finalised;
 
+  /* Adjust the unrotated image. Called once, by prepare_image. */
+  virtual void finish_image() {};
+  void prepare_image();
+  bool prepared;
+
+  /* Render a chunk, but not its overlays. Each type of renderer
+     overrides this to run the render loops of render_loops.hpp
+     instantiated with its own type. */
+  virtual void render_chunk(const chunkbox& chunks);
+
+  /* Render a chunk to Count outputs at once, working on the chunk
+     arrays directly. Only valid for renderers that don't override
+     getblock or getlight. */
+  template <int Count>
+  void render_arrays(const chunkbox& chunks, const output* outputs);
+
+  /* Render a flat map of a chunk, working on the chunk arrays
+     directly. Runs of a block are blended by blend_run. */
+  template <int Count>
+  void render_flat(const chunkbox& chunks, const output* outputs);
+  template <int Count>
+  static void blend_run(Pixel* dots, const output* outputs, Pixel colour,
+                        int count, int light, int y);
+
+  /* Render an oblique map of a chunk facing Dir, working on the chunk
+     arrays directly. */
+  template <direction Dir, int Count>
+  void render_facing_arrays(const chunkbox& chunks, const output* outputs);
+  template <direction Dir, int Count>
+  void render_diagonal_arrays(const chunkbox& chunks, const output* outputs);
+
+  /* Render loops for any type of renderer. Self must be the type of
+     the renderer, and blocks are sampled through Self::getblock and
+     Self::getlight without virtual calls. */
+  template <class Self> void render_columns(const chunkbox& chunks);
+  template <class Self> void render_oblique(const chunkbox& chunks);
+  template <class Self, direction Dir>
+  void render_facing(const chunkbox& chunks);
+  template <class Self, direction Dir>
+  void render_diagonal(const chunkbox& chunks);
+  template <class Self> void blendblock(const chunkbox& chunks, pvector pos,
+                                        direction dir, Pixel& top);
+
   /* Get unlit colour value of a block. */
   virtual Pixel getblock(const chunkbox& chunks, pvector pos,
                          direction dir);
@@ -139,10 +326,6 @@ protected:
   virtual unsigned char getlight(const chunkbox& chunks, pvector pos,
                                  direction dir);
 
-  /* Get a block, light it and blend behind a pixel. */
-  virtual void blendblock(const chunkbox& chunks, pvector pos,
-                          direction dir, Pixel& top);
-
   /* Negate a cardinal or ordinal direction. */
   static direction negate_direction(direction direction);
 